@@ -18,6 +18,31 @@
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct WideBVHNode;
+struct TriangleMesh;
+struct SphereShape;
+struct TriangleBlock;
+struct WatertightRay;
+
+// Branching factor of the traversal BVH: one AVX2 register holds 8 floats,
+// one SSE register 4
+#if defined(__AVX2__)
+constexpr int kBVHWidth = 8;
+#else
+constexpr int kBVHWidth = 4;
+#endif
+
+// What the traversals keep of the closest hit found so far. Only the final
+// one is turned into an Intersection, by BVHAccel::interaction.
+struct HitRecord
+{
+    float t = std::numeric_limits<float>::infinity();
+    // face of the mesh, or index into the array of primitives of this type
+    int primID = -1;
+    float u = 0, v = 0;  // barycentric coordinates of a face hit
+    int geomID = -1;     // for a Mesh hit, the meshes entry whose face it is
+    PrimitiveType type = PrimitiveType::Object;
+};
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -25,26 +50,68 @@ class BVHAccel {
 
 public:
     // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    enum class SplitMethod { NAIVE, SAH, LBVH };
 
     // BVHAccel Public Methods
     BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    // BVH over the faces of mesh, whose leaves test the triangles straight
+    // from its arrays instead of calling an Object per face
+    BVHAccel(const TriangleMesh& mesh, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
     Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
     bool IntersectP(const Ray &ray) const;
+    // Closest hits of the rays of packet in mask, see Object::getIntersectionPacket
+    void IntersectPacket(RayPacket& packet, int mask, Intersection* isect) const;
+    // Mask of the rays of packet in mask that hit anything before their tMax
+    int IntersectPacketP(const RayPacket& packet, int mask) const;
     BVHBuildNode* root;
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
-    BVHBuildNode* recursiveBuild_SAH(std::vector<Object*>objects);
+    void build(std::vector<BVHPrimitiveInfo>& primitiveInfo);
+    void traverse(const Ray& ray, const WatertightRay& wr, HitRecord& hit) const;
+    void getHit(BVHBuildNode* node, const Ray& ray, HitRecord& hit) const;
+    Intersection interaction(const Ray& ray, const HitRecord& hit) const;
+    PrimitiveType leafType(int first, int n) const;
+    void intersectLeaf(PrimitiveType type, int first, int n, const WatertightRay& wr, Ray& ray,
+                       HitRecord& hit) const;
+    bool intersectLeafP(PrimitiveType type, int first, int n, const WatertightRay& wr, const Ray& ray) const;
+    void intersectLeafPacket(PrimitiveType type, int first, int n, RayPacket& packet, int mask,
+                             Intersection* isect) const;
+    int intersectLeafPacketP(PrimitiveType type, int first, int n, const RayPacket& packet, int mask) const;
+    BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end);
+    BVHBuildNode* recursiveBuild_SAH(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end);
+    BVHBuildNode* buildLBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo);
+    BVHBuildNode* recursiveBuild_LBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                                      const std::vector<uint64_t>& mortonCodes,
+                                      int start, int end, int bitIndex);
+    template <typename BuildFunc>
+    void buildChildren(BVHBuildNode* node, int start, int mid, int end, BuildFunc&& build);
+    bool acquireBuildThread();
+    BVHBuildNode* createLeaf(const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                             int start, int end, BVHBuildNode* node);
+    int collapseBVHTree(BVHBuildNode* node);
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    // Every leaf is tagged with the PrimitiveType of its primitives and
+    // references a range of the array of that type
     std::vector<Object*> primitives;
+    std::vector<SphereShape> spheres;
+    std::vector<const BVHAccel*> meshes;
+    // set for a mesh BVH, whose leaves reference faces instead of primitives;
+    // the traversals test the faces of a leaf kTriangleBlockSize at a time
+    // from consecutive triangleBlocks
+    const TriangleMesh* mesh = nullptr;
+    std::vector<int> faces;
+    std::vector<TriangleBlock> triangleBlocks;
+    std::vector<WideBVHNode> nodes;
+    // worker threads currently building subtrees
+    std::atomic<int> buildThreads{0};
+    int maxBuildThreads = 0;
 };
 
 struct BVHBuildNode {
@@ -63,6 +130,29 @@ public:
     }
 };
 
+// Per-primitive data cached for the builders
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3& bounds)
+        : primitiveNumber(primitiveNumber), bounds(bounds),
+          centroid(0.5 * bounds.pMin + 0.5 * bounds.pMax) {}
+    size_t primitiveNumber = 0;
+    Bounds3 bounds;
+    Vector3f centroid;
+};
+
+// Wide BVH node used for traversal. The binary build tree is collapsed so
+// that every node holds up to kBVHWidth children, with the child boxes in SoA
+// layout so that one ray is tested against all of them in a single pass.
+struct alignas(32) WideBVHNode {
+    float bboxMin[3][kBVHWidth];      // [axis][child]
+    float bboxMax[3][kBVHWidth];
+    int child[kBVHWidth];             // interior: node index, leaf: primitivesOffset
+    uint16_t nPrimitives[kBVHWidth];  // 0 -> interior node
+    PrimitiveType type[kBVHWidth];    // leaf: array primitivesOffset indexes
+    int nChildren;                    // unused slots hold empty boxes
+};
+
 
 
 
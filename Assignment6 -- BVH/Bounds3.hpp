@@ -90,37 +90,18 @@ class Bounds3
 
 
 
-inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
-                                const std::array<int, 3>& dirIsNeg) const
+inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir, const std::array<int, 3>&) const
 {
-    // invDir: ray direction(x,y,z), invDir=(1.0/x,1.0/y,1.0/z), use this because Multiply is faster that Division
-    // dirIsNeg: ray direction(x,y,z), dirIsNeg=[int(x>0),int(y>0),int(z>0)], use this to simplify your logic
-    // test if ray bound intersects
-
-    float t_enter;
-    float t_exit;
-    Vector3f t_enter_v3f = (pMin - ray.origin) * invDir;
-    Vector3f t_exit_v3f = (pMax - ray.origin) * invDir;
-
-    // for(int i=0; i<3; ++i) {
-    //     if(!dirIsNeg[i])
-    //         std::swap(t_enter_v3f[i], t_exit_v3f[i]);
-    // }
-    if (!dirIsNeg[0])
-        std::swap(t_enter_v3f.x, t_exit_v3f.x);
-    if (!dirIsNeg[1])
-        std::swap(t_enter_v3f.y, t_exit_v3f.y);
-    if (!dirIsNeg[2])
-        std::swap(t_enter_v3f.z, t_exit_v3f.z);
-
-    t_enter = std::max(t_enter_v3f.x, std::max(t_enter_v3f.y, t_enter_v3f.z));
-    t_exit = std::min(t_exit_v3f.x, std::min(t_exit_v3f.y, t_exit_v3f.z));
-
-    if (t_enter <= t_exit && t_exit >= 0)
-        return true;
-    else
-        return false;
-
+    // Slab distances of all three axes in one SSE register. min and max pick
+    // the near and far plane of each axis, so the sign of the direction
+    // (dirIsNeg) is not needed.
+    Vec3A org(ray.origin), inv(invDir);
+    Vec3A t0 = (Vec3A(pMin) - org) * inv;
+    Vec3A t1 = (Vec3A(pMax) - org) * inv;
+    float tEnter = maxComponent(min(t0, t1));
+    float tExit = minComponent(max(t0, t1));
+    // reject boxes that start behind the closest hit found so far (ray.t_max)
+    return tEnter <= tExit && tExit >= 0 && tEnter <= ray.t_max;
 }
 
 inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
@@ -11,6 +11,13 @@
 #include "Ray.hpp"
 #include "Intersection.hpp"
 
+// Kinds of primitive the BVH traversal tests with inlined code: faces of a
+// TriangleMesh, spheres and meshes with a BVH of their own. Everything else
+// is an Object called through its virtual interface.
+enum class PrimitiveType : uint8_t { Object, Triangle, Sphere, Mesh };
+
+class BVHAccel;
+
 class Object
 {
 public:
@@ -22,6 +29,35 @@ public:
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
+    // Lets a BVH over objects keep spheres and meshes in arrays of their own
+    virtual PrimitiveType primitiveType() const { return PrimitiveType::Object; }
+    // the BVH of a PrimitiveType::Mesh
+    virtual const BVHAccel* getBVH() const { return nullptr; }
+    // Packet versions of getIntersection and intersect for the rays of packet
+    // whose bits are set in mask. Hits nearer than packet.tMax replace the
+    // entry of their lane in isect and shrink its tMax; the any-hit query
+    // returns the mask of rays blocked before their tMax. By default every
+    // ray is handled on its own.
+    virtual void getIntersectionPacket(RayPacket& packet, int mask, Intersection* isect)
+    {
+        for (int i = 0; i < kPacketSize; ++i) {
+            if (!(mask & (1 << i)))
+                continue;
+            Intersection hit = getIntersection(packet.ray(i));
+            if (hit.happened && hit.distance < packet.tMax[i]) {
+                isect[i] = hit;
+                packet.tMax[i] = hit.distance;
+            }
+        }
+    }
+    virtual int intersectPacket(const RayPacket& packet, int mask)
+    {
+        int hitMask = 0;
+        for (int i = 0; i < kPacketSize; ++i)
+            if ((mask & (1 << i)) && intersect(packet.ray(i)))
+                hitMask |= 1 << i;
+        return hitMask;
+    }
 };
 
 
@@ -21,19 +21,44 @@ void Renderer::Render(const Scene& scene)
     float scale = tan(deg2rad(scene.fov * 0.5));
     float imageAspectRatio = scene.width / (float)scene.height;
     Vector3f eye_pos(-1, 5, 10);
-    int m = 0;
-    for (uint32_t j = 0; j < scene.height; ++j) {
-        for (uint32_t i = 0; i < scene.width; ++i) {
-            // generate primary ray direction
-            float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-                      imageAspectRatio * scale;
-            float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-
-            Vector3f dir = normalize(Vector3f(x, y, -1));
-            Ray ray(eye_pos, dir);
-            framebuffer[m++] = scene.castRay(ray, 0);
+    // generate primary ray direction
+    auto cameraRay = [&](uint32_t i, uint32_t j) {
+        float x = (2 * (i + 0.5) / (float)scene.width - 1) *
+                  imageAspectRatio * scale;
+        float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
+
+        Vector3f dir = normalize(Vector3f(x, y, -1));
+        return Ray(eye_pos, dir);
+    };
+    if (packets) {
+        // The camera rays of a 4x2 pixel block go through the BVH as one
+        // packet; only the secondary and shadow rays are traced one by one
+        for (uint32_t j0 = 0; j0 < scene.height; j0 += 2) {
+            for (uint32_t i0 = 0; i0 < scene.width; i0 += 4) {
+                RayPacket packet;
+                for (int lane = 0; lane < kPacketSize; ++lane) {
+                    uint32_t i = i0 + lane % 4, j = j0 + lane / 4;
+                    if (i < scene.width && j < scene.height)
+                        packet.set(lane, cameraRay(i, j));
+                }
+                Intersection isect[kPacketSize];
+                scene.intersectPacket(packet, isect);
+                for (int lane = 0; lane < kPacketSize; ++lane) {
+                    uint32_t i = i0 + lane % 4, j = j0 + lane / 4;
+                    if (packet.active & (1 << lane))
+                        framebuffer[j * scene.width + i] = scene.castRay(cameraRay(i, j), 0, isect[lane]);
+                }
+            }
+            UpdateProgress(j0 / (float)scene.height);
+        }
+    }
+    else {
+        int m = 0;
+        for (uint32_t j = 0; j < scene.height; ++j) {
+            for (uint32_t i = 0; i < scene.width; ++i)
+                framebuffer[m++] = scene.castRay(cameraRay(i, j), 0);
+            UpdateProgress(j / (float)scene.height);
         }
-        UpdateProgress(j / (float)scene.height);
     }
     UpdateProgress(1.f);
 
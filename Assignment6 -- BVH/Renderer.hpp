@@ -17,5 +17,8 @@ class Renderer
 public:
     void Render(const Scene& scene);
 
+    // trace camera rays in packets of 4x2 pixels
+    bool packets = true;
+
 private:
 };
@@ -5,14 +5,14 @@
 #include "Scene.hpp"
 
 
-void Scene::buildBVH() {
+void Scene::buildBVH(BVHAccel::SplitMethod splitMethod) {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh = new BVHAccel(objects, 1, splitMethod);
 }
 
 void Scene::buildSAH() {
     printf(" - Generating SAH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::SAH);
 }
 
 Intersection Scene::intersect(const Ray &ray) const
@@ -20,6 +20,11 @@ Intersection Scene::intersect(const Ray &ray) const
     return this->bvh->Intersect(ray);
 }
 
+void Scene::intersectPacket(RayPacket &packet, Intersection *isect) const
+{
+    this->bvh->IntersectPacket(packet, packet.active, isect);
+}
+
 bool Scene::trace(
         const Ray &ray,
         const std::vector<Object*> &objects,
@@ -60,7 +65,15 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
     if (depth > this->maxDepth) {
         return Vector3f(0.0,0.0,0.0);
     }
-    Intersection intersection = Scene::intersect(ray);
+    return castRay(ray, depth, Scene::intersect(ray));
+}
+
+// castRay for a ray whose closest hit is already known, e.g. from a packet
+Vector3f Scene::castRay(const Ray &ray, int depth, const Intersection &intersection) const
+{
+    if (depth > this->maxDepth) {
+        return Vector3f(0.0,0.0,0.0);
+    }
     Material *m = intersection.m;
     Object *hitObject = intersection.obj;
     Vector3f hitColor = this->backgroundColor;
@@ -134,7 +147,9 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
                         Object *shadowHitObject = nullptr;
                         float tNearShadow = kInfinity;
                         // is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-                        bool inShadow = bvh->Intersect(Ray(shadowPointOrig, lightDir)).happened;
+                        Ray shadowRay(shadowPointOrig, lightDir);
+                        shadowRay.t_max = std::sqrt(lightDistance2);
+                        bool inShadow = bvh->IntersectP(shadowRay);
                         lightAmt += (1 - inShadow) * get_lights()[i]->intensity * LdotN;
                         Vector3f reflectionDirection = reflect(-lightDir, N);
                         specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, ray.direction)),
@@ -32,10 +32,13 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
+    // intersect for every active ray of a packet; isect has kPacketSize entries
+    void intersectPacket(RayPacket& packet, Intersection* isect) const;
     BVHAccel *bvh;
-    void buildBVH();
+    void buildBVH(BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::NAIVE);
     void buildSAH();
     Vector3f castRay(const Ray &ray, int depth) const;
+    Vector3f castRay(const Ray &ray, int depth, const Intersection &intersection) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
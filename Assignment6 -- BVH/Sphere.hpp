@@ -10,6 +10,63 @@
 #include "Bounds3.hpp"
 #include "Material.hpp"
 
+// Analytic ray-sphere test: the nearer root of the quadratic that lies in
+// front of the ray origin, negative if there is none
+inline float intersectSphere(const Ray& ray, const Vector3f& center, float radius2)
+{
+    Vector3f L = ray.origin - center;
+    float a = dotProduct(ray.direction, ray.direction);
+    float b = 2 * dotProduct(ray.direction, L);
+    float c = dotProduct(L, L) - radius2;
+    float t0, t1;
+    if (!solveQuadratic(a, b, c, t0, t1)) return -1;
+    if (t0 < 0) t0 = t1;
+    return t0;
+}
+
+// What a BVH stores of a Sphere to test it without a virtual call
+struct SphereShape
+{
+    Vector3f center;
+    float radius2;
+    Material* m;
+    Object* object;
+
+    // Replace isect by the hit of ray if there is one nearer
+    bool intersect(const Ray& ray, Intersection& isect) const
+    {
+        float t = floatDistance(isect.distance);
+        if (!intersect(ray, t))
+            return false;
+        interaction(ray, t, isect);
+        return true;
+    }
+    // Replace t by the distance of the hit of ray if it is nearer
+    bool intersect(const Ray& ray, float& t) const
+    {
+        float t0 = intersectSphere(ray, center, radius2);
+        if (!(t0 >= 0) || t0 >= t)
+            return false;
+        t = t0;
+        return true;
+    }
+    // The Intersection of the hit of ray at distance t
+    void interaction(const Ray& ray, float t, Intersection& isect) const
+    {
+        isect.happened = true;
+        isect.coords = Vector3f(ray.origin + ray.direction * t);
+        isect.normal = normalize(Vector3f(isect.coords - center));
+        isect.m = m;
+        isect.obj = object;
+        isect.distance = t;
+    }
+    bool intersectP(const Ray& ray) const
+    {
+        float t0 = intersectSphere(ray, center, radius2);
+        return t0 >= 0 && t0 < ray.t_max;
+    }
+};
+
 class Sphere : public Object{
 public:
     Vector3f center;
@@ -18,27 +75,14 @@ public:
     Sphere(const Vector3f &c, const float &r) : center(c), radius(r), radius2(r * r), m(new Material()) {}
     bool intersect(const Ray& ray) {
         // analytic solution
-        Vector3f L = ray.origin - center;
-        float a = dotProduct(ray.direction, ray.direction);
-        float b = 2 * dotProduct(ray.direction, L);
-        float c = dotProduct(L, L) - radius2;
-        float t0, t1;
-        if (!solveQuadratic(a, b, c, t0, t1)) return false;
-        if (t0 < 0) t0 = t1;
+        float t0 = intersectSphere(ray, center, radius2);
         if (t0 < 0) return false;
-        return true;
+        return t0 < ray.t_max;
     }
     bool intersect(const Ray& ray, float &tnear, uint32_t &index) const
     {
         // analytic solution
-        Vector3f L = ray.origin - center;
-        float a = dotProduct(ray.direction, ray.direction);
-        float b = 2 * dotProduct(ray.direction, L);
-        float c = dotProduct(L, L) - radius2;
-        float t0, t1;
-        if (!
-        solveQuadratic(a, b, c, t0, t1)) return false;
-        if (t0 < 0) t0 = t1;
+        float t0 = intersectSphere(ray, center, radius2);
         if (t0 < 0) return false;
         tnear = t0;
 
@@ -47,13 +91,7 @@ public:
     Intersection getIntersection(Ray ray){
         Intersection result;
         result.happened = false;
-        Vector3f L = ray.origin - center;
-        float a = dotProduct(ray.direction, ray.direction);
-        float b = 2 * dotProduct(ray.direction, L);
-        float c = dotProduct(L, L) - radius2;
-        float t0, t1;
-        if (!solveQuadratic(a, b, c, t0, t1)) return result;
-        if (t0 < 0) t0 = t1;
+        float t0 = intersectSphere(ray, center, radius2);
         if (t0 < 0) return result;
         result.happened=true;
 
@@ -65,6 +103,9 @@ public:
         return result;
 
     }
+    PrimitiveType primitiveType() const { return PrimitiveType::Sphere; }
+    SphereShape shape() { return {center, radius2, m, this}; }
+
     void getSurfaceProperties(const Vector3f &P, const Vector3f &I, const uint32_t &index, const Vector2f &uv, Vector3f &N, Vector2f &st) const
     { N = normalize(P - center); }
 
@@ -6,8 +6,10 @@
 #include "OBJ_Loader.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
+#include "TriangleMesh.hpp"
 #include <cassert>
 #include <array>
+#include <map>
 
 bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
@@ -60,6 +62,9 @@ public:
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
     Intersection getIntersection(Ray ray) override;
+    void getIntersectionPacket(RayPacket& packet, int mask, Intersection* isect) override;
+    int intersectPacket(const RayPacket& packet, int mask) override { return intersectLanes(packet, mask, nullptr); }
+    int intersectLanes(const RayPacket& packet, int mask, float* tHit) const;
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const override
@@ -75,7 +80,8 @@ public:
 class MeshTriangle : public Object
 {
 public:
-    MeshTriangle(const std::string& filename)
+    MeshTriangle(const std::string& filename,
+                 BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH)
     {
         objl::Loader loader;
         loader.LoadFile(filename);
@@ -83,58 +89,47 @@ public:
         assert(loader.LoadedMeshes.size() == 1);
         auto mesh = loader.LoadedMeshes[0];
 
-        Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity()};
-        Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-            for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z) *
-                            60.f;
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
-            }
-
-            auto new_mat =
-                new Material(MaterialType::DIFFUSE_AND_GLOSSY,
-                             Vector3f(0.5, 0.5, 0.5), Vector3f(0, 0, 0));
-            new_mat->Kd = 0.6;
-            new_mat->Ks = 0.0;
-            new_mat->specularExponent = 0;
-
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], new_mat);
+        // The loader repeats the vertices of every face, so merge the ones
+        // at the same position into one buffer
+        std::map<std::array<float, 3>, uint32_t> vertexMap;
+        std::vector<uint32_t> remap(mesh.Vertices.size());
+        for (size_t i = 0; i < mesh.Vertices.size(); ++i) {
+            const objl::Vector3& pos = mesh.Vertices[i].Position;
+            auto it = vertexMap.emplace(std::array<float, 3>{pos.X, pos.Y, pos.Z},
+                                        (uint32_t)triangleMesh.vertices.size());
+            if (it.second)
+                triangleMesh.vertices.push_back(Vector3f(pos.X, pos.Y, pos.Z) * 60.f);
+            remap[i] = it.first->second;
         }
 
-        bounding_box = Bounds3(min_vert, max_vert);
+        m = new Material(MaterialType::DIFFUSE_AND_GLOSSY,
+                         Vector3f(0.5, 0.5, 0.5), Vector3f(0, 0, 0));
+        m->Kd = 0.6;
+        m->Ks = 0.0;
+        m->specularExponent = 0;
 
-        std::vector<Object*> ptrs;
-        for (auto& tri : triangles)
-            ptrs.push_back(&tri);
+        triangleMesh.m = m;
+        triangleMesh.object = this;
+        for (size_t i = 0; i + 2 < mesh.Indices.size(); i += 3)
+            triangleMesh.addFace(remap[mesh.Indices[i]], remap[mesh.Indices[i + 1]],
+                                 remap[mesh.Indices[i + 2]]);
+        numTriangles = triangleMesh.numFaces();
 
-        bvh = new BVHAccel(ptrs);
+        for (const Vector3f& vert : triangleMesh.vertices)
+            bounding_box = Union(bounding_box, vert);
+
+        bvh = new BVHAccel(triangleMesh, kTriangleBlockSize, splitMethod);
     }
 
-    bool intersect(const Ray& ray) { return true; }
+    bool intersect(const Ray& ray) { return bvh && bvh->IntersectP(ray); }
 
     bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
     {
         bool intersect = false;
         for (uint32_t k = 0; k < numTriangles; ++k) {
-            const Vector3f& v0 = vertices[vertexIndex[k * 3]];
-            const Vector3f& v1 = vertices[vertexIndex[k * 3 + 1]];
-            const Vector3f& v2 = vertices[vertexIndex[k * 3 + 2]];
+            const Vector3f& v0 = triangleMesh.vertex(k, 0);
+            const Vector3f& v1 = triangleMesh.vertex(k, 1);
+            const Vector3f& v2 = triangleMesh.vertex(k, 2);
             float t, u, v;
             if (rayTriangleIntersect(v0, v1, v2, ray.origin, ray.direction, t,
                                      u, v) &&
@@ -149,30 +144,20 @@ public:
     }
 
     Bounds3 getBounds() { return bounding_box; }
+    PrimitiveType primitiveType() const { return PrimitiveType::Mesh; }
+    const BVHAccel* getBVH() const { return bvh; }
 
+    // Hits come from the BVH with the normal of the face already set, and
+    // the mesh has no texture, so it shades like a single Triangle
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const
     {
-        const Vector3f& v0 = vertices[vertexIndex[index * 3]];
-        const Vector3f& v1 = vertices[vertexIndex[index * 3 + 1]];
-        const Vector3f& v2 = vertices[vertexIndex[index * 3 + 2]];
-        Vector3f e0 = normalize(v1 - v0);
-        Vector3f e1 = normalize(v2 - v1);
-        N = normalize(crossProduct(e0, e1));
-        const Vector2f& st0 = stCoordinates[vertexIndex[index * 3]];
-        const Vector2f& st1 = stCoordinates[vertexIndex[index * 3 + 1]];
-        const Vector2f& st2 = stCoordinates[vertexIndex[index * 3 + 2]];
-        st = st0 * (1 - uv.x - uv.y) + st1 * uv.x + st2 * uv.y;
     }
 
     Vector3f evalDiffuseColor(const Vector2f& st) const
     {
-        float scale = 5;
-        float pattern =
-            (fmodf(st.x * scale, 1) > 0.5) ^ (fmodf(st.y * scale, 1) > 0.5);
-        return lerp(Vector3f(0.815, 0.235, 0.031),
-                    Vector3f(0.937, 0.937, 0.231), pattern);
+        return Vector3f(0.5, 0.5, 0.5);
     }
 
     Intersection getIntersection(Ray ray)
@@ -186,20 +171,30 @@ public:
         return intersec;
     }
 
+    void getIntersectionPacket(RayPacket& packet, int mask, Intersection* isect)
+    {
+        if (bvh)
+            bvh->IntersectPacket(packet, mask, isect);
+    }
+
+    int intersectPacket(const RayPacket& packet, int mask) { return bvh ? bvh->IntersectPacketP(packet, mask) : 0; }
+
     Bounds3 bounding_box;
-    std::unique_ptr<Vector3f[]> vertices;
+    TriangleMesh triangleMesh;
     uint32_t numTriangles;
-    std::unique_ptr<uint32_t[]> vertexIndex;
-    std::unique_ptr<Vector2f[]> stCoordinates;
-
-    std::vector<Triangle> triangles;
 
     BVHAccel* bvh;
 
     Material* m;
 };
 
-inline bool Triangle::intersect(const Ray& ray) { return true; }
+// Occlusion test: same as getIntersection, but only reports whether the
+// hit lies within [0, ray.t_max)
+inline bool Triangle::intersect(const Ray& ray)
+{
+    double t_tmp = intersectTriangle(ray, v0, e1, e2, normal);
+    return t_tmp >= 0 && t_tmp < ray.t_max;
+}
 inline bool Triangle::intersect(const Ray& ray, float& tnear,
                                 uint32_t& index) const
 {
@@ -212,24 +207,10 @@ inline Intersection Triangle::getIntersection(Ray ray)
 {
     Intersection inter;
 
-    if (dotProduct(ray.direction, normal) > 0)
+    double t_tmp = intersectTriangle(ray, v0, e1, e2, normal);
+    // the hit has to lie in front of the ray origin
+    if (t_tmp < 0)
         return inter;
-    double u, v, t_tmp = 0;
-    Vector3f pvec = crossProduct(ray.direction, e2);
-    double det = dotProduct(e1, pvec);
-    if (fabs(det) < EPSILON)
-        return inter;
-
-    double det_inv = 1. / det;
-    Vector3f tvec = ray.origin - v0;
-    u = dotProduct(tvec, pvec) * det_inv;
-    if (u < 0 || u > 1)
-        return inter;
-    Vector3f qvec = crossProduct(tvec, e1);
-    v = dotProduct(ray.direction, qvec) * det_inv;
-    if (v < 0 || u + v > 1)
-        return inter;
-    t_tmp = dotProduct(e2, qvec) * det_inv;
 
     /*Intersection()  //construction
 	{
@@ -244,13 +225,38 @@ inline Intersection Triangle::getIntersection(Ray ray)
     inter.happened = true;
     inter.coords = ray.origin + t_tmp * ray.direction;
     inter.normal = this->normal;
-    inter.distance = dotProduct(t_tmp * ray.direction, t_tmp * ray.direction);
+    // keep the ray parameter so BVH traversal can cull boxes against it
+    inter.distance = t_tmp;
     inter.obj = this;
     inter.m = this->m;
 
     return inter;
 }
 
+inline int Triangle::intersectLanes(const RayPacket& packet, int mask, float* tHit) const
+{
+    return intersectTriangleLanes(packet, mask, v0, e1, e2, normal, tHit);
+}
+
+inline void Triangle::getIntersectionPacket(RayPacket& packet, int mask, Intersection* isect)
+{
+    float tHit[kPacketSize];
+    int hitMask = intersectLanes(packet, mask, tHit);
+    for (int i = 0; i < kPacketSize; ++i) {
+        if (!(hitMask & (1 << i)))
+            continue;
+        Intersection& inter = isect[i];
+        inter.distance = tHit[i];
+        inter.coords = Vector3f(packet.ox[i], packet.oy[i], packet.oz[i]) +
+                       Vector3f(packet.dx[i], packet.dy[i], packet.dz[i]) * tHit[i];
+        inter.happened = true;
+        inter.m = m;
+        inter.normal = normal;
+        inter.obj = this;
+        packet.tMax[i] = tHit[i];
+    }
+}
+
 inline Vector3f Triangle::evalDiffuseColor(const Vector2f&) const
 {
     return Vector3f(0.5, 0.5, 0.5);
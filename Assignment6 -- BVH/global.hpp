@@ -1,6 +1,7 @@
 #pragma once
 #include <iostream>
 #include <cmath>
+#include <limits>
 #include <random>
 
 #undef M_PI
@@ -9,6 +10,12 @@
 extern const float  EPSILON;
 const float kInfinity = std::numeric_limits<float>::max();
 
+// A ray distance in float, the largest ones becoming infinity
+inline float floatDistance(double t)
+{
+    return t < std::numeric_limits<float>::max() ? (float)t : std::numeric_limits<float>::infinity();
+}
+
 inline float clamp(const float &lo, const float &hi, const float &v)
 { return std::max(lo, std::min(hi, v)); }
 
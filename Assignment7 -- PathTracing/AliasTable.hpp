@@ -0,0 +1,73 @@
+//
+// Constant-time sampling of a discrete distribution.
+//
+
+#pragma once
+#include <algorithm>
+#include <vector>
+
+// Walker's alias method, built with Vose's algorithm. Every bin holds the
+// probability q of keeping its own index and the index it defers to
+// otherwise, so drawing an index costs one table lookup regardless of the
+// number of entries.
+class AliasTable
+{
+public:
+    AliasTable() = default;
+
+    explicit AliasTable(const std::vector<float>& weights) : bins(weights.size())
+    {
+        int n = (int)weights.size();
+        double sum = 0;
+        for (float w : weights) sum += w;
+        if (n == 0 || !(sum > 0)) {
+            bins.clear();
+            return;
+        }
+
+        // Scale the probabilities so that the average bin holds exactly 1,
+        // then let every underfull bin borrow its remainder from an overfull one
+        std::vector<double> q(n);
+        std::vector<int> under, over;
+        for (int i = 0; i < n; ++i) {
+            bins[i].p = (float)(weights[i] / sum);
+            q[i] = weights[i] / sum * n;
+            (q[i] < 1 ? under : over).push_back(i);
+        }
+        while (!under.empty() && !over.empty()) {
+            int u = under.back(), o = over.back();
+            under.pop_back();
+            over.pop_back();
+            bins[u].q = (float)q[u];
+            bins[u].alias = o;
+            q[o] -= 1 - q[u];
+            (q[o] < 1 ? under : over).push_back(o);
+        }
+        // Whatever is left is full up to rounding error
+        for (int i : under) bins[i].q = 1, bins[i].alias = i;
+        for (int i : over) bins[i].q = 1, bins[i].alias = i;
+    }
+
+    // Draw an index from one uniform number u in [0, 1) and return its probability in pmf
+    int sample(float u, float* pmf = nullptr) const
+    {
+        int n = (int)bins.size();
+        float x = u * n;
+        int i = std::min((int)x, n - 1);
+        float up = std::min(x - i, 0x1.fffffep-1f);
+        int k = up < bins[i].q ? i : bins[i].alias;
+        if (pmf) *pmf = bins[k].p;
+        return k;
+    }
+
+    float pmf(int i) const { return bins[i].p; }
+    size_t size() const { return bins.size(); }
+    bool empty() const { return bins.empty(); }
+
+private:
+    struct Bin {
+        float q = 1, p = 0;
+        int alias = 0;
+    };
+    std::vector<Bin> bins;
+};
@@ -1,19 +1,237 @@
 #include <algorithm>
 #include <cassert>
+#include <future>
+#include <thread>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "BVH.hpp"
+#include "Sphere.hpp"
+#include "TriangleMesh.hpp"
+
+// Ranges larger than this are built on another thread when one is idle
+static constexpr int kParallelSubtreeThreshold = 4096;
+// Ranges larger than this are also binned and partitioned in parallel
+static constexpr int kParallelPartitionThreshold = 64 * 1024;
+
+static int buildThreadCount()
+{
+    return std::max(1, (int)std::thread::hardware_concurrency());
+}
+
+// Split [start, end) into one chunk per hardware thread and run
+// func(chunkIndex, chunkStart, chunkEnd) on all of them concurrently.
+// Returns the number of chunks.
+template <typename Func>
+static int parallelChunks(int start, int end, Func&& func)
+{
+    int nChunks = std::min(buildThreadCount(), end - start);
+    int chunkSize = (end - start + nChunks - 1) / nChunks;
+    std::vector<std::thread> workers;
+    for (int c = 1; c < nChunks; ++c)
+        workers.emplace_back([&, c]() {
+            func(c, start + c * chunkSize, std::min(end, start + (c + 1) * chunkSize));
+        });
+    func(0, start, std::min(end, start + chunkSize));
+    for (auto& w : workers) w.join();
+    return nChunks;
+}
+
+// Compute bounds of all primitives and of their centroids in [start, end)
+static void computeBounds(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                          Bounds3& bounds, Bounds3& centroidBounds)
+{
+    auto reduce = [&](int s, int e, Bounds3& b, Bounds3& cb) {
+        for (int i = s; i < e; ++i) {
+            b = Union(b, primitiveInfo[i].bounds);
+            cb = Union(cb, primitiveInfo[i].centroid);
+        }
+    };
+    if (end - start < kParallelPartitionThreshold) {
+        reduce(start, end, bounds, centroidBounds);
+        return;
+    }
+    std::vector<Bounds3> chunkBounds(buildThreadCount()), chunkCentroidBounds(buildThreadCount());
+    int nChunks = parallelChunks(start, end, [&](int c, int s, int e) {
+        reduce(s, e, chunkBounds[c], chunkCentroidBounds[c]);
+    });
+    for (int c = 0; c < nChunks; ++c) {
+        bounds = Union(bounds, chunkBounds[c]);
+        centroidBounds = Union(centroidBounds, chunkCentroidBounds[c]);
+    }
+}
+
+// Stable two-way partition of [start, end) done by all hardware threads:
+// every chunk counts its left-side elements, a prefix sum gives each chunk
+// its output offsets and the chunks then scatter into a scratch buffer.
+// Returns the index of the first element for which pred is false.
+template <typename Pred>
+static int parallelPartition(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, Pred pred)
+{
+    std::vector<int> leftCount(buildThreadCount(), 0);
+    int nChunks = parallelChunks(start, end, [&](int c, int s, int e) {
+        for (int i = s; i < e; ++i)
+            leftCount[c] += pred(primitiveInfo[i]);
+    });
+    std::vector<int> leftOffset(nChunks), rightOffset(nChunks);
+    int nLeft = 0;
+    for (int c = 0; c < nChunks; ++c) {
+        leftOffset[c] = nLeft;
+        nLeft += leftCount[c];
+    }
+    int nRight = 0;
+    int chunkSize = (end - start + nChunks - 1) / nChunks;
+    for (int c = 0; c < nChunks; ++c) {
+        rightOffset[c] = nLeft + nRight;
+        nRight += std::min(end, start + (c + 1) * chunkSize) - (start + c * chunkSize) - leftCount[c];
+    }
+
+    std::vector<BVHPrimitiveInfo> scratch(end - start);
+    parallelChunks(start, end, [&](int c, int s, int e) {
+        int l = leftOffset[c], r = rightOffset[c];
+        for (int i = s; i < e; ++i)
+            scratch[pred(primitiveInfo[i]) ? l++ : r++] = primitiveInfo[i];
+    });
+    parallelChunks(start, end, [&](int, int s, int e) {
+        std::copy(scratch.begin() + (s - start), scratch.begin() + (e - start), primitiveInfo.begin() + s);
+    });
+    return start + nLeft;
+}
+
+// Spread the lower 21 bits of x so that two zero bits separate each of them
+static inline uint64_t leftShift3(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+// 63-bit Morton code of a point quantized to [0, 2^21)^3; bit i belongs to
+// axis i % 3
+static inline uint64_t encodeMorton3(float x, float y, float z)
+{
+    return (leftShift3((uint64_t)z) << 2) | (leftShift3((uint64_t)y) << 1) | leftShift3((uint64_t)x);
+}
+
+struct MortonPrimitive {
+    int primitiveIndex;
+    uint64_t mortonCode;
+};
+
+// LSD radix sort on the Morton codes, 8 bits per pass
+static void radixSort(std::vector<MortonPrimitive>* v)
+{
+    std::vector<MortonPrimitive> tempVector(v->size());
+    constexpr int bitsPerPass = 8;
+    constexpr int nBits = 64;
+    constexpr int nPasses = nBits / bitsPerPass;
+    constexpr int nBuckets = 1 << bitsPerPass;
+    constexpr uint64_t bitMask = nBuckets - 1;
+    for (int pass = 0; pass < nPasses; ++pass) {
+        int lowBit = pass * bitsPerPass;
+        std::vector<MortonPrimitive>& in = (pass & 1) ? tempVector : *v;
+        std::vector<MortonPrimitive>& out = (pass & 1) ? *v : tempVector;
+
+        // Count the keys per bucket and turn the counts into output offsets
+        int bucketCount[nBuckets] = {0};
+        for (const MortonPrimitive& mp : in)
+            bucketCount[(mp.mortonCode >> lowBit) & bitMask]++;
+        int outIndex[nBuckets];
+        outIndex[0] = 0;
+        for (int i = 1; i < nBuckets; ++i)
+            outIndex[i] = outIndex[i - 1] + bucketCount[i - 1];
+
+        for (const MortonPrimitive& mp : in)
+            out[outIndex[(mp.mortonCode >> lowBit) & bitMask]++] = mp;
+    }
+    // an even number of passes leaves the result in *v
+    static_assert(nPasses % 2 == 0, "radixSort expects an even number of passes");
+}
 
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
                    SplitMethod splitMethod)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
       primitives(std::move(p))
 {
-    time_t start, stop;
-    time(&start);
     if (primitives.empty())
         return;
 
-    root = recursiveBuild(primitives);
-    //root = recursiveBuild_SAH(primitives);
+    // Cache bounds and centroids so the builders never have to query the
+    // primitives again
+    int nPrimitives = (int)primitives.size();
+    std::vector<BVHPrimitiveInfo> primitiveInfo(nPrimitives);
+    auto initInfo = [&](int, int s, int e) {
+        for (int i = s; i < e; ++i)
+            primitiveInfo[i] = BVHPrimitiveInfo(i, primitives[i]->getBounds());
+    };
+    if (nPrimitives < kParallelPartitionThreshold)
+        initInfo(0, 0, nPrimitives);
+    else
+        parallelChunks(0, nPrimitives, initInfo);
+    build(primitiveInfo);
+}
+
+BVHAccel::BVHAccel(const TriangleMesh& mesh, int maxPrimsInNode,
+                   SplitMethod splitMethod)
+    : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
+      mesh(&mesh)
+{
+    int nFaces = mesh.numFaces();
+    if (nFaces == 0)
+        return;
+
+    std::vector<BVHPrimitiveInfo> primitiveInfo(nFaces);
+    auto initInfo = [&](int, int s, int e) {
+        for (int i = s; i < e; ++i)
+            primitiveInfo[i] = BVHPrimitiveInfo(i, mesh.faceBounds(i));
+    };
+    if (nFaces < kParallelPartitionThreshold)
+        initInfo(0, 0, nFaces);
+    else
+        parallelChunks(0, nFaces, initInfo);
+    build(primitiveInfo);
+}
+
+// Build the tree over primitiveInfo, which ends up in the order of the leaves
+void BVHAccel::build(std::vector<BVHPrimitiveInfo>& primitiveInfo)
+{
+    time_t start, stop;
+    time(&start);
+    int nPrimitives = (int)primitiveInfo.size();
+
+    // The calling thread takes part in the build, so only the other
+    // hardware threads are handed out to subtrees
+    maxBuildThreads = buildThreadCount() - 1;
+    if (splitMethod == SplitMethod::SAH)
+        root = recursiveBuild_SAH(primitiveInfo, 0, nPrimitives);
+    else if (splitMethod == SplitMethod::LBVH)
+        root = buildLBVH(primitiveInfo);
+    else
+        root = recursiveBuild(primitiveInfo, 0, nPrimitives);
+
+    // Leaves reference ranges of primitiveInfo, so put the primitives in
+    // the same order
+    if (mesh) {
+        faces.resize(nPrimitives);
+        for (int i = 0; i < nPrimitives; ++i)
+            faces[i] = (int)primitiveInfo[i].primitiveNumber;
+    }
+    else {
+        std::vector<Object*> orderedPrims(nPrimitives);
+        for (int i = 0; i < nPrimitives; ++i)
+            orderedPrims[i] = primitives[primitiveInfo[i].primitiveNumber];
+        primitives.swap(orderedPrims);
+    }
+
+    // Collapse the tree into a depth-first array of wide nodes for traversal
+    nodes.reserve(nPrimitives / (kBVHWidth - 1) + 1);
+    collapseBVHTree(root);
 
     time(&stop);
     double diff = difftime(stop, start);
@@ -21,223 +239,870 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
     int mins = ((int)diff / 60) - (hrs * 60);
     int secs = (int)diff - (hrs * 3600) - (mins * 60);
 
-    printf("\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n", hrs, mins, secs);
-    //printf("\rSAH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n", hrs, mins, secs);
+    const char* methodName = splitMethod == SplitMethod::SAH ? "SAH" :
+                             splitMethod == SplitMethod::LBVH ? "LBVH" : "BVH";
+    printf("\r%s Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n",
+           methodName, hrs, mins, secs);
 
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+bool BVHAccel::acquireBuildThread()
 {
-    BVHBuildNode* node = new BVHBuildNode();
+    int n = buildThreads.load();
+    while (n < maxBuildThreads)
+        if (buildThreads.compare_exchange_weak(n, n + 1))
+            return true;
+    return false;
+}
 
-    // Compute bounds of all primitives in BVH node
-    Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
+template <typename BuildFunc>
+void BVHAccel::buildChildren(BVHBuildNode* node, int start, int mid, int end, BuildFunc&& build)
+{
+    if (end - start >= kParallelSubtreeThreshold && acquireBuildThread()) {
+        // Hand the left subtree to another thread and build the right one here
+        auto left = std::async(std::launch::async, [&]() { return build(start, mid); });
+        node->right = build(mid, end);
+        node->left = left.get();
+        buildThreads--;
+    }
+    else {
+        node->left = build(start, mid);
+        node->right = build(mid, end);
+    }
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+}
+
+BVHBuildNode* BVHAccel::createLeaf(const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                                   int start, int end, BVHBuildNode* node)
+{
+    node->firstPrimOffset = start;
+    node->nPrimitives = end - start;
+    for (int i = start; i < end; ++i)
+        node->bounds = Union(node->bounds, primitiveInfo[i].bounds);
+    if (node->nPrimitives == 1 && !mesh)
+        node->object = primitives[primitiveInfo[start].primitiveNumber];
+    return node;
+}
+
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end)
+{
+    BVHBuildNode* node = new BVHBuildNode();
+    int nPrimitives = end - start;
+    if (nPrimitives <= maxPrimsInNode) {
         // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        node->area = objects[0]->getArea();
-        return node;
+        return createLeaf(primitiveInfo, start, end, node);
     }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
-        return node;
+    // Split at the median centroid along the axis of largest extent
+    Bounds3 bounds, centroidBounds;
+    computeBounds(primitiveInfo, start, end, bounds, centroidBounds);
+    int dim = centroidBounds.maxExtent();
+    int mid = start + nPrimitives / 2;
+    std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
+                     [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                         return a.centroid[dim] < b.centroid[dim];
+                     });
+
+    node->splitAxis = dim;
+    buildChildren(node, start, mid, end, [&](int s, int e) {
+        return recursiveBuild(primitiveInfo, s, e);
+    });
+    return node;
+}
+
+BVHBuildNode* BVHAccel::recursiveBuild_SAH(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end)
+{
+    BVHBuildNode* node = new BVHBuildNode();
+    int nPrimitives = end - start;
+    if (nPrimitives == 1) {
+        // Create leaf _SAHBuildNode_
+        return createLeaf(primitiveInfo, start, end, node);
     }
-    else {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds =
-                Union(centroidBounds, objects[i]->getBounds().Centroid());
-        int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                       f2->getBounds().Centroid().x;
-            });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                       f2->getBounds().Centroid().y;
-            });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                       f2->getBounds().Centroid().z;
+
+    // Compute bounds of all primitives and of their centroids in SAH node
+    Bounds3 bounds, centroidBounds;
+    computeBounds(primitiveInfo, start, end, bounds, centroidBounds);
+
+    // Fall back to an equal-count split when the centroids cannot be separated
+    int dim = centroidBounds.maxExtent();
+    int mid = start + nPrimitives / 2;
+
+    // Bin the centroids along every axis and evaluate the SAH cost of each
+    // bucket boundary: cost = t_trav + (N_A * S_A + N_B * S_B) / S_C
+    constexpr int nBuckets = 16;
+    struct BucketInfo {
+        int count = 0;
+        Bounds3 bounds;
+    };
+    // Intersecting a primitive costs 1 in these units. The faces of a mesh
+    // are tested kTriangleBlockSize at a time for about the cost of one.
+    auto primCost = [&](int count) {
+        return mesh ? (float)((count + kTriangleBlockSize - 1) / kTriangleBlockSize) : (float)count;
+    };
+    float invArea = 1.0f / bounds.SurfaceArea();
+    float minCost = std::numeric_limits<float>::infinity();
+    int minCostAxis = -1, minCostSplit = -1;
+    const Bounds3& cb = centroidBounds;
+    for (int axis = 0; axis < 3; ++axis) {
+        float cmin = cb.pMin[axis];
+        float extent = cb.pMax[axis] - cmin;
+        if (!(extent > 0))
+            continue;
+
+        BucketInfo buckets[nBuckets];
+        auto binRange = [&](int s, int e, BucketInfo* bins) {
+            for (int i = s; i < e; ++i) {
+                const BVHPrimitiveInfo& pi = primitiveInfo[i];
+                int b = (int)(nBuckets * ((pi.centroid[axis] - cmin) / extent));
+                if (b == nBuckets) b = nBuckets - 1;
+                bins[b].count++;
+                bins[b].bounds = Union(bins[b].bounds, pi.bounds);
+            }
+        };
+        if (nPrimitives < kParallelPartitionThreshold)
+            binRange(start, end, buckets);
+        else {
+            // Bin chunks concurrently, then merge the per-chunk buckets
+            std::vector<BucketInfo> chunkBuckets(buildThreadCount() * nBuckets);
+            int nChunks = parallelChunks(start, end, [&](int c, int s, int e) {
+                binRange(s, e, &chunkBuckets[c * nBuckets]);
             });
-            break;
+            for (int c = 0; c < nChunks; ++c)
+                for (int b = 0; b < nBuckets; ++b) {
+                    buckets[b].count += chunkBuckets[c * nBuckets + b].count;
+                    buckets[b].bounds = Union(buckets[b].bounds, chunkBuckets[c * nBuckets + b].bounds);
+                }
         }
 
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
+        // Sweep from the right to collect everything above each boundary ...
+        int countAbove[nBuckets - 1];
+        float areaAbove[nBuckets - 1];
+        Bounds3 b1;
+        int count1 = 0;
+        for (int i = nBuckets - 1; i > 0; --i) {
+            b1 = Union(b1, buckets[i].bounds);
+            count1 += buckets[i].count;
+            countAbove[i - 1] = count1;
+            areaAbove[i - 1] = count1 > 0 ? b1.SurfaceArea() : 0.0f;
+        }
+        // ... then from the left, evaluating the cost at every boundary
+        Bounds3 b0;
+        int count0 = 0;
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            b0 = Union(b0, buckets[i].bounds);
+            count0 += buckets[i].count;
+            if (count0 == 0 || countAbove[i] == 0)
+                continue;
+            float cost = 0.125f +
+                         (primCost(count0) * b0.SurfaceArea() + primCost(countAbove[i]) * areaAbove[i]) * invArea;
+            if (cost < minCost) {
+                minCost = cost;
+                minCostAxis = axis;
+                minCostSplit = i;
+            }
+        }
+    }
+
+    // Keep the range as a leaf when no split is cheaper
+    if (nPrimitives <= maxPrimsInNode && primCost(nPrimitives) <= minCost)
+        return createLeaf(primitiveInfo, start, end, node);
+
+    if (minCostAxis >= 0) {
+        // Partition primitives in place at the cheapest bucket boundary
+        dim = minCostAxis;
+        float cmin = cb.pMin[dim];
+        float extent = cb.pMax[dim] - cmin;
+        auto isLeft = [=](const BVHPrimitiveInfo& pi) {
+            int b = (int)(nBuckets * ((pi.centroid[dim] - cmin) / extent));
+            if (b == nBuckets) b = nBuckets - 1;
+            return b <= minCostSplit;
+        };
+        if (nPrimitives < kParallelPartitionThreshold) {
+            BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1, isLeft);
+            mid = (int)(pmid - &primitiveInfo[0]);
+        }
+        else
+            mid = parallelPartition(primitiveInfo, start, end, isLeft);
+    }
 
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
+    node->splitAxis = dim;
+    buildChildren(node, start, mid, end, [&](int s, int e) {
+        return recursiveBuild_SAH(primitiveInfo, s, e);
+    });
+    return node;
+}
 
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+BVHBuildNode* BVHAccel::buildLBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo)
+{
+    int nPrimitives = (int)primitiveInfo.size();
+    Bounds3 bounds, centroidBounds;
+    computeBounds(primitiveInfo, 0, nPrimitives, bounds, centroidBounds);
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+    // Quantize every centroid to a 2^21 grid over the centroid bounds and
+    // compute its Morton code
+    std::vector<MortonPrimitive> mortonPrims(nPrimitives);
+    const Bounds3& cb = centroidBounds;
+    auto computeCodes = [&](int, int s, int e) {
+        constexpr int mortonBits = 21;
+        constexpr float mortonScale = 1 << mortonBits;
+        for (int i = s; i < e; ++i) {
+            Vector3f o = cb.Offset(primitiveInfo[i].centroid);
+            mortonPrims[i].primitiveIndex = i;
+            mortonPrims[i].mortonCode = encodeMorton3(std::min(o.x * mortonScale, mortonScale - 1),
+                                                      std::min(o.y * mortonScale, mortonScale - 1),
+                                                      std::min(o.z * mortonScale, mortonScale - 1));
+        }
+    };
+    if (nPrimitives < kParallelPartitionThreshold)
+        computeCodes(0, 0, nPrimitives);
+    else
+        parallelChunks(0, nPrimitives, computeCodes);
+
+    radixSort(&mortonPrims);
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
+    // Reorder the primitive info to Morton order so that every subtree
+    // covers a contiguous range
+    std::vector<BVHPrimitiveInfo> sortedInfo(nPrimitives);
+    std::vector<uint64_t> mortonCodes(nPrimitives);
+    for (int i = 0; i < nPrimitives; ++i) {
+        sortedInfo[i] = primitiveInfo[mortonPrims[i].primitiveIndex];
+        mortonCodes[i] = mortonPrims[i].mortonCode;
     }
+    primitiveInfo.swap(sortedInfo);
 
-    return node;
+    return recursiveBuild_LBVH(primitiveInfo, mortonCodes, 0, nPrimitives, 62);
 }
-BVHBuildNode* BVHAccel::recursiveBuild_SAH(std::vector<Object*> objects)
+
+BVHBuildNode* BVHAccel::recursiveBuild_LBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                                            const std::vector<uint64_t>& mortonCodes,
+                                            int start, int end, int bitIndex)
 {
     BVHBuildNode* node = new BVHBuildNode();
-    // std::cout<<objects.size()<<std::endl;
-
-    // Compute bounds of all primitives in SAH node
-    Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
-        // Create leaf _SAHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        return node;
+    int nPrimitives = end - start;
+    if (nPrimitives <= maxPrimsInNode) {
+        // Create leaf _LBVHBuildNode_
+        return createLeaf(primitiveInfo, start, end, node);
     }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuild_SAH(std::vector{objects[0]});
-        node->right = recursiveBuild_SAH(std::vector{objects[1]});
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        return node;
+    // All codes in the range agree on the bits above bitIndex. Skip the bits
+    // they also agree on, then binary search for the first code with the
+    // next bit set: that is where the range splits.
+    int mid = -1;
+    for (; bitIndex >= 0; --bitIndex) {
+        uint64_t mask = uint64_t(1) << bitIndex;
+        if ((mortonCodes[start] & mask) == (mortonCodes[end - 1] & mask))
+            continue;
+        int lo = start, hi = end - 1;
+        while (lo + 1 != hi) {
+            int m = (lo + hi) / 2;
+            if (mortonCodes[m] & mask)
+                hi = m;
+            else
+                lo = m;
+        }
+        mid = hi;
+        break;
     }
+    if (mid < 0) {
+        // Identical codes: just halve the range
+        mid = start + nPrimitives / 2;
+        node->splitAxis = 0;
+    }
+    else
+        node->splitAxis = bitIndex % 3;
+
+    buildChildren(node, start, mid, end, [&](int s, int e) {
+        return recursiveBuild_LBVH(primitiveInfo, mortonCodes, s, e, bitIndex - 1);
+    });
+    return node;
+}
+
+int BVHAccel::collapseBVHTree(BVHBuildNode* node)
+{
+    // Pull grandchildren up into this node until it has kBVHWidth children,
+    // always opening the interior child with the largest surface area
+    BVHBuildNode* children[kBVHWidth];
+    int nChildren = 0;
+    if (node->nPrimitives > 0)
+        children[nChildren++] = node;  // leaf root
     else {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds =
-            Union(centroidBounds, objects[i]->getBounds().Centroid());
-        int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                    f2->getBounds().Centroid().x;
-                });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                    f2->getBounds().Centroid().y;
-                });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                    f2->getBounds().Centroid().z;
-                });
-            break;
+        children[nChildren++] = node->left;
+        children[nChildren++] = node->right;
+        while (nChildren < kBVHWidth) {
+            int best = -1;
+            double bestArea = -1;
+            for (int i = 0; i < nChildren; ++i) {
+                if (children[i]->nPrimitives == 0 && children[i]->bounds.SurfaceArea() > bestArea) {
+                    best = i;
+                    bestArea = children[i]->bounds.SurfaceArea();
+                }
+            }
+            if (best < 0)
+                break;
+            BVHBuildNode* open = children[best];
+            children[best] = open->left;
+            children[nChildren++] = open->right;
         }
+    }
 
-        int B_size = 10;
-        int minCostIdx = 1;
-        float minCost = std::numeric_limits<float>::infinity();
-        float SC = bounds.SurfaceArea();
-        // float SC = centroidBounds.SurfaceArea();
-
-        auto beginning = objects.begin();
-        auto ending = objects.end();
+    int offset = (int)nodes.size();
+    nodes.emplace_back();
+    nodes[offset].nChildren = nChildren;
+    for (int i = 0; i < kBVHWidth; ++i) {
+        if (i >= nChildren) {
+            // empty slot: a box no ray can enter
+            for (int axis = 0; axis < 3; ++axis) {
+                nodes[offset].bboxMin[axis][i] = std::numeric_limits<float>::infinity();
+                nodes[offset].bboxMax[axis][i] = -std::numeric_limits<float>::infinity();
+            }
+            nodes[offset].child[i] = -1;
+            nodes[offset].nPrimitives[i] = 0;
+            nodes[offset].type[i] = PrimitiveType::Object;
+            continue;
+        }
+        const Bounds3& b = children[i]->bounds;
+        nodes[offset].bboxMin[0][i] = b.pMin.x;
+        nodes[offset].bboxMin[1][i] = b.pMin.y;
+        nodes[offset].bboxMin[2][i] = b.pMin.z;
+        nodes[offset].bboxMax[0][i] = b.pMax.x;
+        nodes[offset].bboxMax[1][i] = b.pMax.y;
+        nodes[offset].bboxMax[2][i] = b.pMax.z;
+        if (children[i]->nPrimitives > 0) {
+            // Copy the primitives of a leaf to the array of their type
+            int first = children[i]->firstPrimOffset, n = children[i]->nPrimitives;
+            PrimitiveType type = leafType(first, n);
+            int primitivesOffset = first;
+            if (type == PrimitiveType::Sphere) {
+                primitivesOffset = (int)spheres.size();
+                for (int k = first; k < first + n; ++k)
+                    spheres.push_back(static_cast<Sphere*>(primitives[k])->shape());
+            }
+            else if (type == PrimitiveType::Mesh) {
+                primitivesOffset = (int)meshes.size();
+                for (int k = first; k < first + n; ++k)
+                    meshes.push_back(primitives[k]->getBVH());
+            }
+            else if (type == PrimitiveType::Triangle) {
+                primitivesOffset = (int)triangleBlocks.size();
+                for (int k = first; k < first + n; k += kTriangleBlockSize) {
+                    triangleBlocks.emplace_back();
+                    mesh->fillBlock(triangleBlocks.back(), &faces[k], std::min(kTriangleBlockSize, first + n - k));
+                }
+            }
+            nodes[offset].child[i] = primitivesOffset;
+            nodes[offset].nPrimitives[i] = (uint16_t)n;
+            nodes[offset].type[i] = type;
+        }
+        else {
+            // nodes may reallocate while the subtree is collapsed
+            int childOffset = collapseBVHTree(children[i]);
+            nodes[offset].child[i] = childOffset;
+            nodes[offset].nPrimitives[i] = 0;
+            nodes[offset].type[i] = PrimitiveType::Object;
+        }
+    }
+    return offset;
+}
 
-        for (int i = 1; i < B_size; ++i) {// search minCost and minCostIdx
-            auto middling = objects.begin() + std::max(1, (int)(objects.size() * i / B_size));
+// Slab test of one ray against all child boxes of a wide node. Writes the
+// entry distance of every child and returns a bit mask of the children hit in
+// front of tMax. dirIsNeg[i] is set for a positive direction component, as in
+// Bounds3::IntersectP.
+static inline int intersectChildren(const WideBVHNode& node, const float org[3], const float invDir[3],
+                                    const int dirIsNeg[3], float tMax, float tEnter[kBVHWidth])
+{
+#if defined(__AVX2__)
+    __m256 tNear = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+    __m256 tFar = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    for (int axis = 0; axis < 3; ++axis) {
+        const float* nearPlane = dirIsNeg[axis] ? node.bboxMin[axis] : node.bboxMax[axis];
+        const float* farPlane = dirIsNeg[axis] ? node.bboxMax[axis] : node.bboxMin[axis];
+        __m256 o = _mm256_set1_ps(org[axis]), inv = _mm256_set1_ps(invDir[axis]);
+        tNear = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearPlane), o), inv), tNear);
+        tFar = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farPlane), o), inv), tFar);
+    }
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ),
+                               _mm256_and_ps(_mm256_cmp_ps(tFar, _mm256_setzero_ps(), _CMP_GE_OQ),
+                                             _mm256_cmp_ps(tNear, _mm256_set1_ps(tMax), _CMP_LE_OQ)));
+    _mm256_storeu_ps(tEnter, tNear);
+    return _mm256_movemask_ps(hit);
+#elif defined(__SSE2__)
+    __m128 tNear = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+    __m128 tFar = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    for (int axis = 0; axis < 3; ++axis) {
+        const float* nearPlane = dirIsNeg[axis] ? node.bboxMin[axis] : node.bboxMax[axis];
+        const float* farPlane = dirIsNeg[axis] ? node.bboxMax[axis] : node.bboxMin[axis];
+        __m128 o = _mm_set1_ps(org[axis]), inv = _mm_set1_ps(invDir[axis]);
+        tNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearPlane), o), inv), tNear);
+        tFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farPlane), o), inv), tFar);
+    }
+    __m128 hit = _mm_and_ps(_mm_cmple_ps(tNear, tFar),
+                            _mm_and_ps(_mm_cmpge_ps(tFar, _mm_setzero_ps()),
+                                       _mm_cmple_ps(tNear, _mm_set1_ps(tMax))));
+    _mm_storeu_ps(tEnter, tNear);
+    return _mm_movemask_ps(hit);
+#else
+    int mask = 0;
+    for (int i = 0; i < kBVHWidth; ++i) {
+        float tNear = -std::numeric_limits<float>::infinity();
+        float tFar = std::numeric_limits<float>::infinity();
+        for (int axis = 0; axis < 3; ++axis) {
+            float nearPlane = dirIsNeg[axis] ? node.bboxMin[axis][i] : node.bboxMax[axis][i];
+            float farPlane = dirIsNeg[axis] ? node.bboxMax[axis][i] : node.bboxMin[axis][i];
+            tNear = std::max((nearPlane - org[axis]) * invDir[axis], tNear);
+            tFar = std::min((farPlane - org[axis]) * invDir[axis], tFar);
+        }
+        tEnter[i] = tNear;
+        if (tNear <= tFar && tFar >= 0 && tNear <= tMax)
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
 
-            auto leftshapes = std::vector<Object*>(beginning, middling);
-            auto rightshapes = std::vector<Object*>(middling, ending);
+// Type of the primitives [first, first + n) if they all have the same one
+PrimitiveType BVHAccel::leafType(int first, int n) const
+{
+    if (mesh)
+        return PrimitiveType::Triangle;
+    PrimitiveType type = primitives[first]->primitiveType();
+    for (int i = first + 1; i < first + n; ++i)
+        if (primitives[i]->primitiveType() != type)
+            return PrimitiveType::Object;
+    return type;
+}
 
-            assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+// The leaf tests of the traversals. Each switches once on the type of the
+// leaf and then runs the inlined test of that type over its primitives; only
+// leaves of other Objects make virtual calls.
 
-            Bounds3 leftbounds, rightbounds;
+// Number of triangleBlocks holding the n faces of a leaf
+static inline int numBlocks(int n)
+{
+    return (n + kTriangleBlockSize - 1) / kTriangleBlockSize;
+}
 
-            for (int j = 0; j < leftshapes.size(); ++j) {
-                leftbounds = Union(leftbounds, leftshapes[j]->getBounds());
-                // leftbounds = Union(leftbounds, leftshapes[j]->getBounds().Centroid());
+// Closest hit among the primitives of a leaf, nearer than hit; ray.t_max
+// shrinks to it. wr is ray set up for the triangles of a mesh BVH.
+void BVHAccel::intersectLeaf(PrimitiveType type, int first, int n, const WatertightRay& wr, Ray& ray,
+                             HitRecord& hit) const
+{
+    switch (type) {
+    case PrimitiveType::Triangle:
+        for (int i = first; i < first + numBlocks(n); ++i) {
+            int face = mesh->intersectBlock(triangleBlocks[i], wr, hit.t, hit.u, hit.v);
+            if (face >= 0) {
+                hit.primID = face;
+                hit.type = type;
+                ray.t_max = hit.t;
             }
-
-            for (int j = 0; j < rightshapes.size(); ++j) {
-                rightbounds = Union(rightbounds, rightshapes[j]->getBounds());
-                // rightbounds = Union(rightbounds, rightshapes[j]->getBounds().Centroid());
+        }
+        break;
+    case PrimitiveType::Sphere:
+        for (int i = first; i < first + n; ++i)
+            if (spheres[i].intersect(ray, hit.t)) {
+                hit.primID = i;
+                hit.type = type;
+                ray.t_max = hit.t;
+            }
+        break;
+    case PrimitiveType::Mesh:
+        // the mesh BVH records the face it hits, this the mesh
+        for (int i = first; i < first + n; ++i) {
+            float t = hit.t;
+            meshes[i]->traverse(ray, wr, hit);
+            if (hit.t < t) {
+                hit.geomID = i;
+                hit.type = type;
+                ray.t_max = hit.t;
             }
+        }
+        break;
+    default:
+        // other Objects only give a full Intersection; it is computed again
+        // by interaction if it stays the closest
+        for (int i = first; i < first + n; ++i) {
+            Intersection isect = primitives[i]->getIntersection(ray);
+            if (isect.happened && isect.distance < hit.t) {
+                hit.t = (float)isect.distance;
+                hit.primID = i;
+                hit.type = type;
+                ray.t_max = hit.t;
+            }
+        }
+    }
+}
 
-            float SA = leftbounds.SurfaceArea();
-            float SB = rightbounds.SurfaceArea();
-            float c_A_B = leftshapes.size() * SA / SC + rightshapes.size() * SB / SC + 0.125f;
+bool BVHAccel::intersectLeafP(PrimitiveType type, int first, int n, const WatertightRay& wr,
+                              const Ray& ray) const
+{
+    if (type == PrimitiveType::Triangle) {
+        for (int i = first; i < first + numBlocks(n); ++i)
+            if (mesh->intersectBlockP(triangleBlocks[i], wr, ray))
+                return true;
+        return false;
+    }
+    for (int i = first; i < first + n; ++i) {
+        switch (type) {
+        case PrimitiveType::Sphere: if (spheres[i].intersectP(ray)) return true; break;
+        case PrimitiveType::Mesh: if (meshes[i]->IntersectP(ray)) return true; break;
+        default: if (primitives[i]->intersect(ray)) return true;
+        }
+    }
+    return false;
+}
 
-            if (c_A_B < minCost) {
-                minCost = c_A_B;
-                minCostIdx = i;
+void BVHAccel::intersectLeafPacket(PrimitiveType type, int first, int n, RayPacket& packet, int mask,
+                                   Intersection* isect) const
+{
+    // the faces of a block are tested one at a time against all the rays
+    if (type == PrimitiveType::Triangle) {
+        for (int i = first; i < first + numBlocks(n); ++i)
+            for (int k = 0; k < triangleBlocks[i].n; ++k)
+                mesh->intersectPacket(triangleBlocks[i].face[k], packet, mask, isect);
+        return;
+    }
+    for (int i = first; i < first + n; ++i) {
+        switch (type) {
+        case PrimitiveType::Sphere:
+            for (int lane = 0; lane < kPacketSize; ++lane) {
+                Intersection hit;
+                if ((mask & (1 << lane)) && spheres[i].intersect(packet.ray(lane), hit) &&
+                    hit.distance < packet.tMax[lane]) {
+                    isect[lane] = hit;
+                    packet.tMax[lane] = hit.distance;
+                }
             }
+            break;
+        case PrimitiveType::Mesh:
+            meshes[i]->IntersectPacket(packet, mask, isect);
+            break;
+        default:
+            primitives[i]->getIntersectionPacket(packet, mask, isect);
         }
+    }
+}
 
-        auto middling_minCost = objects.begin() + std::max(1, ((int)objects.size() * minCostIdx / B_size));
-        auto leftshapes_minCost = std::vector<Object*>(beginning, middling_minCost);
-        auto rightshapes_minCost = std::vector<Object*>(middling_minCost, ending);
-
-        assert(objects.size() == (leftshapes_minCost.size() + rightshapes_minCost.size()));
+// Mask of the rays in mask that a primitive of the leaf blocks
+int BVHAccel::intersectLeafPacketP(PrimitiveType type, int first, int n, const RayPacket& packet, int mask) const
+{
+    int occluded = 0;
+    if (type == PrimitiveType::Triangle) {
+        for (int i = first; i < first + numBlocks(n) && mask; ++i)
+            for (int k = 0; k < triangleBlocks[i].n && mask; ++k) {
+                int hits = mesh->intersectPacketP(triangleBlocks[i].face[k], packet, mask);
+                occluded |= hits;
+                mask &= ~hits;
+            }
+        return occluded;
+    }
+    for (int i = first; i < first + n && mask; ++i) {
+        int hits = 0;
+        switch (type) {
+        case PrimitiveType::Sphere:
+            for (int lane = 0; lane < kPacketSize; ++lane)
+                if ((mask & (1 << lane)) && spheres[i].intersectP(packet.ray(lane)))
+                    hits |= 1 << lane;
+            break;
+        case PrimitiveType::Mesh:
+            hits = meshes[i]->IntersectPacketP(packet, mask);
+            break;
+        default:
+            hits = primitives[i]->intersectPacket(packet, mask);
+        }
+        occluded |= hits;
+        mask &= ~hits;
+    }
+    return occluded;
+}
 
-        // std::cout<<leftshapes_minCost.size()<<" "<<rightshapes_minCost.size()<<std::endl;
-        node->left = recursiveBuild_SAH(leftshapes_minCost);
-        node->right = recursiveBuild_SAH(rightshapes_minCost);
+// Pending subtree (nPrimitives == 0) or leaf of a traversal, with the
+// distance at which the ray enters it so that entries behind a hit found
+// after they were pushed can be skipped
+struct BVHStackEntry {
+    int index;
+    int nPrimitives;
+    float tEnter;
+    PrimitiveType type;
+};
+// Every level of the tree leaves at most kBVHWidth - 1 entries behind
+static constexpr int kBVHStackSize = 128 * kBVHWidth;
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
+// Sort the children hit far to near and push them in that order, so that the
+// nearest one is visited next
+static inline void pushChildren(const WideBVHNode& node, int hitMask, const float tEnter[kBVHWidth],
+                                BVHStackEntry* nodesToVisit, int& toVisitOffset)
+{
+    int order[kBVHWidth], nHits = 0;
+    for (int i = 0; i < node.nChildren; ++i) {
+        if (!(hitMask & (1 << i)))
+            continue;
+        int k = nHits++;
+        for (; k > 0 && tEnter[order[k - 1]] < tEnter[i]; --k)
+            order[k] = order[k - 1];
+        order[k] = i;
+    }
+    for (int k = 0; k < nHits; ++k) {
+        int i = order[k];
+        nodesToVisit[toVisitOffset++] = {node.child[i], node.nPrimitives[i], tEnter[i], node.type[i]};
     }
-
-    return node;
 }
+
 Intersection BVHAccel::Intersect(const Ray& ray) const
+{
+    HitRecord hit;
+    traverse(ray, WatertightRay(ray), hit);
+    return interaction(ray, hit);
+}
+
+// Closest hit of ray nearer than hit. The traversal moves only the few words
+// of a HitRecord around; wr is ray set up for the triangle tests.
+void BVHAccel::traverse(const Ray& ray, const WatertightRay& wr, HitRecord& hit) const
+{
+    if (nodes.empty())
+        return;
+    // Local copy of the ray whose t_max shrinks to the closest hit found so far,
+    // so that boxes behind it are rejected
+    Ray r = ray;
+    if (hit.t < r.t_max)
+        r.t_max = hit.t;
+    const float org[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    const float invDir[3] = {ray.direction_inv.x, ray.direction_inv.y, ray.direction_inv.z};
+    const int dirIsNeg[3] = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+
+    BVHStackEntry nodesToVisit[kBVHStackSize];
+    int toVisitOffset = 0;
+    nodesToVisit[toVisitOffset++] = {0, 0, -std::numeric_limits<float>::infinity()};
+    while (toVisitOffset > 0) {
+        BVHStackEntry entry = nodesToVisit[--toVisitOffset];
+        if (entry.tEnter > r.t_max)
+            continue;
+        if (entry.nPrimitives > 0) {
+            // Intersect ray with primitives in leaf BVH node
+            intersectLeaf(entry.type, entry.index, entry.nPrimitives, wr, r, hit);
+            continue;
+        }
+
+        const WideBVHNode& node = nodes[entry.index];
+        float tEnter[kBVHWidth];
+        int hitMask = intersectChildren(node, org, invDir, dirIsNeg, (float)r.t_max, tEnter);
+
+        pushChildren(node, hitMask, tEnter, nodesToVisit, toVisitOffset);
+    }
+}
+
+// The Intersection of ray at the hit a traversal found
+Intersection BVHAccel::interaction(const Ray& ray, const HitRecord& hit) const
 {
     Intersection isect;
-    if (!root)
+    if (hit.primID < 0)
         return isect;
-    isect = BVHAccel::getIntersection(root, ray);
+    switch (hit.type) {
+    case PrimitiveType::Triangle: mesh->interaction(hit.primID, ray, hit.t, isect); break;
+    case PrimitiveType::Sphere: spheres[hit.primID].interaction(ray, hit.t, isect); break;
+    case PrimitiveType::Mesh: meshes[hit.geomID]->mesh->interaction(hit.primID, ray, hit.t, isect); break;
+    default: isect = primitives[hit.primID]->getIntersection(ray);
+    }
     return isect;
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+bool BVHAccel::IntersectP(const Ray& ray) const
 {
-    Intersection isect;
-    // Traverse the BVH to find intersection
-    if (!node->bounds.IntersectP(ray, ray.direction_inv, std::array<int, 3> {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0}))
-        return isect;
-    if (node->object != nullptr)
-        return node->object->getIntersection(ray);
+    if (nodes.empty())
+        return false;
+    const float org[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    const float invDir[3] = {ray.direction_inv.x, ray.direction_inv.y, ray.direction_inv.z};
+    const int dirIsNeg[3] = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+    const WatertightRay wr(ray);
+
+    // Any hit in [0, ray.t_max) answers the query, so the traversal stops at
+    // the first primitive that reports one. Near children are still visited
+    // first since occluders close to the origin are the most likely to be hit.
+    BVHStackEntry nodesToVisit[kBVHStackSize];
+    int toVisitOffset = 0;
+    nodesToVisit[toVisitOffset++] = {0, 0, -std::numeric_limits<float>::infinity()};
+    while (toVisitOffset > 0) {
+        BVHStackEntry entry = nodesToVisit[--toVisitOffset];
+        if (entry.nPrimitives > 0) {
+            if (intersectLeafP(entry.type, entry.index, entry.nPrimitives, wr, ray))
+                return true;
+            continue;
+        }
+
+        const WideBVHNode& node = nodes[entry.index];
+        float tEnter[kBVHWidth];
+        int hitMask = intersectChildren(node, org, invDir, dirIsNeg, (float)ray.t_max, tEnter);
+        pushChildren(node, hitMask, tEnter, nodesToVisit, toVisitOffset);
+    }
+    return false;
+}
+
+// Slab test of every ray of a packet against one box. Writes the entry
+// distance of every ray and returns a bit mask of the rays that hit it in
+// front of their tMax. Unlike intersectChildren the rays may point anywhere,
+// so the near and far planes are picked per lane with min and max.
+static inline int intersectPacketBox(const RayPacket& packet, const float bboxMin[3], const float bboxMax[3],
+                                     float tEnter[kPacketSize])
+{
+    const float* org[3] = {packet.ox, packet.oy, packet.oz};
+    const float* invDir[3] = {packet.invDx, packet.invDy, packet.invDz};
+#if defined(__AVX2__)
+    __m256 tNear = _mm256_setzero_ps();
+    __m256 tFar = _mm256_load_ps(packet.tMax);
+    for (int axis = 0; axis < 3; ++axis) {
+        __m256 o = _mm256_load_ps(org[axis]), inv = _mm256_load_ps(invDir[axis]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bboxMin[axis]), o), inv);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bboxMax[axis]), o), inv);
+        tNear = _mm256_max_ps(_mm256_min_ps(t0, t1), tNear);
+        tFar = _mm256_min_ps(_mm256_max_ps(t0, t1), tFar);
+    }
+    _mm256_storeu_ps(tEnter, tNear);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ));
+#elif defined(__SSE2__)
+    int mask = 0;
+    for (int half = 0; half < kPacketSize; half += 4) {
+        __m128 tNear = _mm_setzero_ps();
+        __m128 tFar = _mm_load_ps(packet.tMax + half);
+        for (int axis = 0; axis < 3; ++axis) {
+            __m128 o = _mm_load_ps(org[axis] + half), inv = _mm_load_ps(invDir[axis] + half);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bboxMin[axis]), o), inv);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bboxMax[axis]), o), inv);
+            tNear = _mm_max_ps(_mm_min_ps(t0, t1), tNear);
+            tFar = _mm_min_ps(_mm_max_ps(t0, t1), tFar);
+        }
+        _mm_storeu_ps(tEnter + half, tNear);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) << half;
+    }
+    return mask;
+#else
+    int mask = 0;
+    for (int i = 0; i < kPacketSize; ++i) {
+        float tNear = 0, tFar = packet.tMax[i];
+        for (int axis = 0; axis < 3; ++axis) {
+            float t0 = (bboxMin[axis] - org[axis][i]) * invDir[axis][i];
+            float t1 = (bboxMax[axis] - org[axis][i]) * invDir[axis][i];
+            tNear = std::max(std::min(t0, t1), tNear);
+            tFar = std::min(std::max(t0, t1), tFar);
+        }
+        tEnter[i] = tNear;
+        if (tNear <= tFar)
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
 
-    Intersection isect_left, isect_right;
-    isect_left = getIntersection(node->left, ray);
-    isect_right = getIntersection(node->right, ray);
+// Pending subtree or leaf of a packet traversal and the rays that reach it
+struct PacketStackEntry {
+    int index;
+    int nPrimitives;
+    int mask;
+    PrimitiveType type;
+};
 
-    return isect_left.distance <= isect_right.distance ? isect_left : isect_right;
+// Test the rays of entry against every child box of a wide node and push the
+// children that any of them hits, far to near along the first of those rays
+static inline void pushPacketChildren(const WideBVHNode& node, const RayPacket& packet, int mask,
+                                      PacketStackEntry* nodesToVisit, int& toVisitOffset)
+{
+    int order[kBVHWidth], childMask[kBVHWidth], nHits = 0;
+    float key[kBVHWidth];
+    for (int i = 0; i < node.nChildren; ++i) {
+        const float bboxMin[3] = {node.bboxMin[0][i], node.bboxMin[1][i], node.bboxMin[2][i]};
+        const float bboxMax[3] = {node.bboxMax[0][i], node.bboxMax[1][i], node.bboxMax[2][i]};
+        float tEnter[kPacketSize];
+        childMask[i] = intersectPacketBox(packet, bboxMin, bboxMax, tEnter) & mask;
+        if (!childMask[i])
+            continue;
+        key[i] = tEnter[__builtin_ctz(childMask[i])];
+        int k = nHits++;
+        for (; k > 0 && key[order[k - 1]] < key[i]; --k)
+            order[k] = order[k - 1];
+        order[k] = i;
+    }
+    for (int k = 0; k < nHits; ++k) {
+        int i = order[k];
+        nodesToVisit[toVisitOffset++] = {node.child[i], node.nPrimitives[i], childMask[i], node.type[i]};
+    }
 }
 
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
-    if(node->left == nullptr || node->right == nullptr){
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
+void BVHAccel::IntersectPacket(RayPacket& packet, int mask, Intersection* isect) const
+{
+    mask &= packet.active;
+    if (nodes.empty() || !mask)
         return;
+    PacketStackEntry nodesToVisit[kBVHStackSize];
+    int toVisitOffset = 0;
+    nodesToVisit[toVisitOffset++] = {0, 0, mask};
+    while (toVisitOffset > 0) {
+        PacketStackEntry entry = nodesToVisit[--toVisitOffset];
+        if (entry.nPrimitives > 0) {
+            intersectLeafPacket(entry.type, entry.index, entry.nPrimitives, packet, entry.mask, isect);
+            continue;
+        }
+        pushPacketChildren(nodes[entry.index], packet, entry.mask, nodesToVisit, toVisitOffset);
     }
-    if(p < node->left->area) getSample(node->left, p, pos, pdf);
-    else getSample(node->right, p - node->left->area, pos, pdf);
 }
 
-void BVHAccel::Sample(Intersection &pos, float &pdf){
-    float p = std::sqrt(get_random_float()) * root->area;
-    getSample(root, p, pos, pdf);
-    pdf /= root->area;
-}
\ No newline at end of file
+int BVHAccel::IntersectPacketP(const RayPacket& packet, int mask) const
+{
+    mask &= packet.active;
+    if (nodes.empty() || !mask)
+        return 0;
+    // rays leave the traversal as soon as they are found blocked
+    int occluded = 0;
+    PacketStackEntry nodesToVisit[kBVHStackSize];
+    int toVisitOffset = 0;
+    nodesToVisit[toVisitOffset++] = {0, 0, mask};
+    while (toVisitOffset > 0) {
+        PacketStackEntry entry = nodesToVisit[--toVisitOffset];
+        int live = entry.mask & ~occluded;
+        if (!live)
+            continue;
+        if (entry.nPrimitives > 0) {
+            occluded |= intersectLeafPacketP(entry.type, entry.index, entry.nPrimitives, packet, live);
+            if (occluded == mask)
+                return occluded;
+            continue;
+        }
+        pushPacketChildren(nodes[entry.index], packet, live, nodesToVisit, toVisitOffset);
+    }
+    return occluded;
+}
+
+Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+{
+    HitRecord hit;
+    getHit(node, ray, hit);
+    return interaction(ray, hit);
+}
+
+// Recursive traversal of the binary tree for getIntersection
+void BVHAccel::getHit(BVHBuildNode* node, const Ray& ray, HitRecord& hit) const
+{
+    // Traverse the BVH to find intersection
+    if (!node->bounds.IntersectP(ray, ray.direction_inv, std::array<int, 3> {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0}))
+        return;
+    if (node->nPrimitives > 0) {
+        // leaf node: closest hit among its primitives
+        for (int i = node->firstPrimOffset; i < node->firstPrimOffset + node->nPrimitives; ++i) {
+            if (mesh) {
+                if (mesh->intersect(faces[i], WatertightRay(ray), hit.t, hit.u, hit.v)) {
+                    hit.primID = faces[i];
+                    hit.type = PrimitiveType::Triangle;
+                }
+                continue;
+            }
+            Intersection isect = primitives[i]->getIntersection(ray);
+            if (isect.happened && isect.distance < hit.t) {
+                hit.t = (float)isect.distance;
+                hit.primID = i;
+                hit.type = PrimitiveType::Object;
+            }
+        }
+        return;
+    }
+
+    getHit(node->left, ray, hit);
+    getHit(node->right, ray, hit);
+}
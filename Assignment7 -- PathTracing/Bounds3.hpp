@@ -88,22 +88,18 @@ class Bounds3
                            const std::array<int, 3>& dirisNeg) const;
 };
 
-inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir, const std::array<int, 3>& dirIsNeg) const
+inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir, const std::array<int, 3>&) const
 {
-    float tEnter = -std::numeric_limits<float>::infinity();
-    float tExit = std::numeric_limits<float>::infinity();
-    for (int i = 0; i < 3; i++)
-    {
-        float min = (pMin[i] - ray.origin[i]) * invDir[i];
-        float max = (pMax[i] - ray.origin[i]) * invDir[i];
-        if (!dirIsNeg[i])
-        {
-            std::swap(min, max);
-        }
-        tEnter = std::max(min, tEnter);
-        tExit = std::min(max, tExit);
-    }
-    return tEnter <= tExit && tExit >= 0;
+    // Slab distances of all three axes in one SSE register. min and max pick
+    // the near and far plane of each axis, so the sign of the direction
+    // (dirIsNeg) is not needed.
+    Vec3A org(ray.origin), inv(invDir);
+    Vec3A t0 = (Vec3A(pMin) - org) * inv;
+    Vec3A t1 = (Vec3A(pMax) - org) * inv;
+    float tEnter = maxComponent(min(t0, t1));
+    float tExit = minComponent(max(t0, t1));
+    // reject boxes that start behind the closest hit found so far (ray.t_max)
+    return tEnter <= tExit && tExit >= 0 && tEnter <= ray.t_max;
 }
 
 
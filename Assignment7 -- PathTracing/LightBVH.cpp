@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <cassert>
+#include "LightBVH.hpp"
+#include "Object.hpp"
+
+static float safeSqrt(float x) { return std::sqrt(std::max(0.f, x)); }
+static float safeACos(float x) { return std::acos(clamp(-1, 1, x)); }
+static float length(const Vector3f& v) { return std::sqrt(dotProduct(v, v)); }
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+static float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+    return cosA > cosB ? 1 : cosA * cosB + sinA * sinB;
+}
+static float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+    return cosA > cosB ? 0 : sinA * cosB - cosA * sinB;
+}
+
+float LightBounds::importance(const Vector3f& p, const Vector3f& n) const
+{
+    // Distance to the center of the bounds, clamped so that points inside
+    // the bounds do not get an unbounded importance
+    Vector3f pc = 0.5 * bounds.pMin + 0.5 * bounds.pMax;
+    Vector3f d = p - pc;
+    float dist2 = dotProduct(d, d);
+    float d2 = std::max(dist2, length(bounds.Diagonal()) / 2);
+    float dist = std::sqrt(dist2);
+
+    // Angle between w and the direction to p, minus the spread of the normals
+    // and the angle the bounds subtend from p, bounds the angle at which light
+    // can leave toward p
+    float cosTheta_w = dist > 0 ? dotProduct(w, d) / dist : 1;
+    float sinTheta_w = safeSqrt(1 - cosTheta_w * cosTheta_w);
+    float radius2 = dotProduct(bounds.Diagonal(), bounds.Diagonal()) / 4;
+    float cosTheta_b = dist2 < radius2 ? -1 : safeSqrt(1 - radius2 / dist2);
+    float sinTheta_b = safeSqrt(1 - cosTheta_b * cosTheta_b);
+    float sinTheta_o = safeSqrt(1 - cosTheta_o * cosTheta_o);
+    float cosTheta_x = cosSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+    float sinTheta_x = sinSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+    float cosThetap = cosSubClamped(sinTheta_x, cosTheta_x, sinTheta_b, cosTheta_b);
+    if (cosThetap <= cosTheta_e)
+        return 0;
+    float importance = phi * cosThetap / d2;
+
+    // The same bound for the angle of incidence at the receiver
+    if (dist > 0) {
+        float cosTheta_i = -dotProduct(d, n) / dist;
+        float sinTheta_i = safeSqrt(1 - cosTheta_i * cosTheta_i);
+        importance *= std::max(0.f, cosSubClamped(sinTheta_i, cosTheta_i, sinTheta_b, cosTheta_b));
+    }
+    return std::max(importance, 0.f);
+}
+
+LightBounds Union(const LightBounds& a, const LightBounds& b)
+{
+    if (a.phi == 0) return b;
+    if (b.phi == 0) return a;
+
+    // Smallest cone containing both normal cones
+    Vector3f w;
+    float cosTheta_o;
+    float theta_a = safeACos(a.cosTheta_o), theta_b = safeACos(b.cosTheta_o);
+    float theta_d = safeACos(dotProduct(a.w, b.w));
+    if (std::min(theta_d + theta_b, M_PI) <= theta_a) {
+        w = a.w;
+        cosTheta_o = a.cosTheta_o;
+    }
+    else if (std::min(theta_d + theta_a, M_PI) <= theta_b) {
+        w = b.w;
+        cosTheta_o = b.cosTheta_o;
+    }
+    else {
+        float theta_o = (theta_a + theta_d + theta_b) / 2;
+        Vector3f axis = crossProduct(a.w, b.w);
+        if (theta_o >= M_PI || dotProduct(axis, axis) == 0) {
+            w = a.w;
+            cosTheta_o = -1;
+        }
+        else {
+            // rotate a.w toward b.w by theta_o - theta_a
+            float theta_r = theta_o - theta_a;
+            w = normalize(a.w * std::cos(theta_r) + crossProduct(normalize(axis), a.w) * std::sin(theta_r));
+            cosTheta_o = std::cos(theta_o);
+        }
+    }
+    return LightBounds(Union(a.bounds, b.bounds), w, a.phi + b.phi, cosTheta_o,
+                       std::min(a.cosTheta_e, b.cosTheta_e));
+}
+
+// Surface area orientation heuristic: power times the solid angle the light
+// can reach times the surface area of the bounds, with a penalty for thin
+// boxes split along their short axis
+static float evaluateCost(const LightBounds& b, const Bounds3& bounds, int dim)
+{
+    float theta_o = safeACos(b.cosTheta_o), theta_e = safeACos(b.cosTheta_e);
+    float theta_w = std::min(theta_o + theta_e, M_PI);
+    float sinTheta_o = safeSqrt(1 - b.cosTheta_o * b.cosTheta_o);
+    float M_omega = 2 * M_PI * (1 - b.cosTheta_o) +
+                    M_PI / 2 * (2 * theta_w * sinTheta_o - std::cos(theta_o - 2 * theta_w) -
+                                2 * theta_o * sinTheta_o + b.cosTheta_o);
+    const Vector3f d = bounds.Diagonal();
+    float Kr = std::max(d.x, std::max(d.y, d.z)) / std::max(d[dim], 1e-6f);
+    return b.phi * M_omega * Kr * (float)b.bounds.SurfaceArea();
+}
+
+LightBVH::LightBVH(const std::vector<Object*>& emitters)
+{
+    std::vector<BVHLight> bvhLights;
+    for (Object* emitter : emitters) {
+        LightBounds lb = emitter->getLightBounds();
+        if (!(lb.phi > 0))
+            continue;
+        bvhLights.push_back({(int)lights.size(), lb, 0.5 * lb.bounds.pMin + 0.5 * lb.bounds.pMax});
+        lights.push_back(emitter);
+    }
+    if (bvhLights.empty())
+        return;
+    nodes.reserve(2 * bvhLights.size() - 1);
+    buildRecursive(bvhLights, 0, (int)bvhLights.size(), 0, 0);
+}
+
+int LightBVH::buildRecursive(std::vector<BVHLight>& bvhLights, int start, int end, uint64_t bitTrail, int depth)
+{
+    if (end - start == 1) {
+        int nodeIndex = (int)nodes.size();
+        nodes.push_back({bvhLights[start].lightBounds, bvhLights[start].lightIndex, true});
+        bitTrails[lights[bvhLights[start].lightIndex]] = bitTrail;
+        return nodeIndex;
+    }
+
+    Bounds3 bounds, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        bounds = Union(bounds, bvhLights[i].lightBounds.bounds);
+        centroidBounds = Union(centroidBounds, bvhLights[i].centroid);
+    }
+
+    // Bin the centroids along every axis and take the cheapest bucket boundary
+    constexpr int nBuckets = 12;
+    float minCost = std::numeric_limits<float>::infinity();
+    int minCostSplitBucket = -1, minCostSplitDim = -1;
+    const Bounds3& cb = centroidBounds;
+    auto bucketOf = [&](const BVHLight& light, int dim) {
+        const Vector3f o = cb.Offset(light.centroid);
+        int b = (int)(nBuckets * o[dim]);
+        return std::min(std::max(b, 0), nBuckets - 1);
+    };
+    for (int dim = 0; dim < 3; ++dim) {
+        if (!(cb.pMax[dim] > cb.pMin[dim]))
+            continue;
+        LightBounds bucketLightBounds[nBuckets];
+        for (int i = start; i < end; ++i) {
+            int b = bucketOf(bvhLights[i], dim);
+            bucketLightBounds[b] = Union(bucketLightBounds[b], bvhLights[i].lightBounds);
+        }
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            LightBounds b0, b1;
+            for (int j = 0; j <= i; ++j) b0 = Union(b0, bucketLightBounds[j]);
+            for (int j = i + 1; j < nBuckets; ++j) b1 = Union(b1, bucketLightBounds[j]);
+            if (b0.phi == 0 || b1.phi == 0)
+                continue;
+            float cost = evaluateCost(b0, bounds, dim) + evaluateCost(b1, bounds, dim);
+            if (cost > 0 && cost < minCost) {
+                minCost = cost;
+                minCostSplitBucket = i;
+                minCostSplitDim = dim;
+            }
+        }
+    }
+
+    // The bit trail has room for 64 levels; fall back to halving the range
+    // when no split separates the lights or the tree gets too deep
+    int mid;
+    if (minCostSplitDim < 0 || depth >= 32) {
+        mid = (start + end) / 2;
+        int dim = cb.maxExtent();
+        std::nth_element(&bvhLights[start], &bvhLights[mid], &bvhLights[end - 1] + 1,
+                         [dim](const BVHLight& a, const BVHLight& b) {
+                             const Vector3f& ca = a.centroid;
+                             const Vector3f& cb = b.centroid;
+                             return ca[dim] < cb[dim];
+                         });
+    }
+    else {
+        BVHLight* pmid = std::partition(&bvhLights[start], &bvhLights[end - 1] + 1,
+                                        [&](const BVHLight& light) {
+                                            return bucketOf(light, minCostSplitDim) <= minCostSplitBucket;
+                                        });
+        mid = (int)(pmid - &bvhLights[0]);
+    }
+
+    int nodeIndex = (int)nodes.size();
+    nodes.emplace_back();
+    buildRecursive(bvhLights, start, mid, bitTrail, depth + 1);
+    int secondChild = buildRecursive(bvhLights, mid, end, bitTrail | (uint64_t(1) << depth), depth + 1);
+    nodes[nodeIndex] = {Union(nodes[nodeIndex + 1].lightBounds, nodes[secondChild].lightBounds),
+                        secondChild, false};
+    return nodeIndex;
+}
+
+Object* LightBVH::sample(const Vector3f& p, const Vector3f& n, float u, float& pmf) const
+{
+    pmf = 1;
+    int nodeIndex = 0;
+    if (empty())
+        return nullptr;
+    while (!nodes[nodeIndex].isLeaf) {
+        // choose a child in proportion to its importance and reuse u
+        int child0 = nodeIndex + 1, child1 = nodes[nodeIndex].childOrLightIndex;
+        float ci0 = nodes[child0].lightBounds.importance(p, n);
+        float ci1 = nodes[child1].lightBounds.importance(p, n);
+        if (ci0 == 0 && ci1 == 0)
+            return nullptr;
+        float p0 = ci0 / (ci0 + ci1);
+        if (u < p0) {
+            nodeIndex = child0;
+            u = std::min(u / p0, 0x1.fffffep-1f);
+            pmf *= p0;
+        }
+        else {
+            nodeIndex = child1;
+            u = std::min((u - p0) / (1 - p0), 0x1.fffffep-1f);
+            pmf *= 1 - p0;
+        }
+    }
+    if (nodes[nodeIndex].lightBounds.importance(p, n) == 0)
+        return nullptr;
+    return lights[nodes[nodeIndex].childOrLightIndex];
+}
+
+float LightBVH::pmf(const Vector3f& p, const Vector3f& n, const Object* light) const
+{
+    auto it = bitTrails.find(light);
+    if (it == bitTrails.end())
+        return 0;
+    uint64_t bitTrail = it->second;
+    float pmf = 1;
+    int nodeIndex = 0;
+    while (!nodes[nodeIndex].isLeaf) {
+        int child0 = nodeIndex + 1, child1 = nodes[nodeIndex].childOrLightIndex;
+        float ci0 = nodes[child0].lightBounds.importance(p, n);
+        float ci1 = nodes[child1].lightBounds.importance(p, n);
+        if (ci0 == 0 && ci1 == 0)
+            return 0;
+        if (bitTrail & 1) {
+            pmf *= ci1 / (ci0 + ci1);
+            nodeIndex = child1;
+        }
+        else {
+            pmf *= ci0 / (ci0 + ci1);
+            nodeIndex = child0;
+        }
+        bitTrail >>= 1;
+    }
+    return pmf;
+}
@@ -0,0 +1,73 @@
+//
+// Light hierarchy for importance sampling scenes with many emitters.
+//
+
+#pragma once
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "Bounds3.hpp"
+#include "Vector.hpp"
+
+class Object;
+
+// Bounds of the light leaving a set of emitters: all of it leaves from inside
+// bounds, from surfaces whose normals lie within theta_o of w, in directions
+// at most theta_e away from the normal. phi is the total emitted power.
+// (Conty Estevez and Kulla, "Importance Sampling of Many Lights with Adaptive
+// Tree Splitting", 2018)
+struct LightBounds
+{
+    Bounds3 bounds;
+    Vector3f w = Vector3f(0, 0, 1);
+    float phi = 0;
+    float cosTheta_o = 1;
+    float cosTheta_e = 0;
+
+    LightBounds() {}
+    LightBounds(const Bounds3& bounds, const Vector3f& w, float phi, float cosTheta_o, float cosTheta_e)
+        : bounds(bounds), w(w), phi(phi), cosTheta_o(cosTheta_o), cosTheta_e(cosTheta_e) {}
+
+    // Conservative estimate of the light reaching a receiver at p with normal n
+    float importance(const Vector3f& p, const Vector3f& n) const;
+};
+
+LightBounds Union(const LightBounds& a, const LightBounds& b);
+
+// Binary tree over emissive primitives. Every node stores the LightBounds of
+// its subtree; sampling walks from the root and picks each child in
+// proportion to its importance at the shading point, so lights that are far
+// away, small or facing away are rarely chosen.
+class LightBVH
+{
+public:
+    LightBVH() {}
+    explicit LightBVH(const std::vector<Object*>& emitters);
+
+    bool empty() const { return nodes.empty(); }
+
+    // Choose an emitter for a receiver at p with normal n from one uniform
+    // number. Returns nullptr if no emitter can contribute.
+    Object* sample(const Vector3f& p, const Vector3f& n, float u, float& pmf) const;
+    // Probability that sample() chooses light for a receiver at p with normal n
+    float pmf(const Vector3f& p, const Vector3f& n, const Object* light) const;
+
+private:
+    struct LightBVHNode {
+        LightBounds lightBounds;
+        int childOrLightIndex;  // interior: second child, leaf: index into lights
+        bool isLeaf;
+    };
+    struct BVHLight {
+        int lightIndex;
+        LightBounds lightBounds;
+        Vector3f centroid;
+    };
+
+    int buildRecursive(std::vector<BVHLight>& bvhLights, int start, int end, uint64_t bitTrail, int depth);
+
+    std::vector<Object*> lights;
+    std::vector<LightBVHNode> nodes;
+    // path from the root to every light, bit i set for a second child at depth i
+    std::unordered_map<const Object*, uint64_t> bitTrails;
+};
@@ -71,8 +71,8 @@ private:
         // kt = 1 - kr;
     }
 
-    Vector3f toWorld(const Vector3f &a, const Vector3f &N){
-        Vector3f B, C;
+    // Orthonormal basis (B, C, N) around the normal
+    void localFrame(const Vector3f &N, Vector3f &B, Vector3f &C){
         if (std::fabs(N.x) > std::fabs(N.y)){
             float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
             C = Vector3f(N.z * invLen, 0.0f, -N.x *invLen);
@@ -82,8 +82,65 @@ private:
             C = Vector3f(0.0f, N.z * invLen, -N.y *invLen);
         }
         B = crossProduct(C, N);
+    }
+
+    Vector3f toWorld(const Vector3f &a, const Vector3f &N){
+        Vector3f B, C;
+        localFrame(N, B, C);
         return a.x * B + a.y * C + a.z * N;
     }
+
+    Vector3f toLocal(const Vector3f &a, const Vector3f &N){
+        Vector3f B, C;
+        localFrame(N, B, C);
+        return Vector3f(dotProduct(a, B), dotProduct(a, C), dotProduct(a, N));
+    }
+
+    // cosine-weighted direction on the hemisphere around z, pdf = cos / PI
+    Vector3f sampleCosineHemisphere(float x_1, float x_2)
+    {
+        float r = std::sqrt(x_1), phi = 2 * M_PI * x_2;
+        return Vector3f(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::max(0.0f, 1.0f - x_1)));
+    }
+
+    // Sample a microfacet normal from the GGX distribution of normals visible
+    // from V, in the local frame where the macro normal is z
+    // (Heitz, "Sampling the GGX Distribution of Visible Normals", JCGT 2018)
+    Vector3f sampleGGXVNDF(const Vector3f &V, float alpha, float x_1, float x_2)
+    {
+        // stretch the view vector so the distribution becomes a hemisphere
+        Vector3f Vh = normalize(Vector3f(alpha * V.x, alpha * V.y, V.z));
+        float lensq = Vh.x * Vh.x + Vh.y * Vh.y;
+        Vector3f T1 = lensq > 0 ? Vector3f(-Vh.y, Vh.x, 0) / std::sqrt(lensq) : Vector3f(1, 0, 0);
+        Vector3f T2 = crossProduct(Vh, T1);
+        // uniform point on the projected half disk
+        float r = std::sqrt(x_1), phi = 2 * M_PI * x_2;
+        float t1 = r * std::cos(phi), t2 = r * std::sin(phi);
+        float s = 0.5f * (1.0f + Vh.z);
+        t2 = (1.0f - s) * std::sqrt(std::max(0.0f, 1.0f - t1 * t1)) + s * t2;
+        // reproject onto the hemisphere and unstretch
+        Vector3f Nh = t1 * T1 + t2 * T2 + std::sqrt(std::max(0.0f, 1.0f - t1 * t1 - t2 * t2)) * Vh;
+        return normalize(Vector3f(alpha * Nh.x, alpha * Nh.y, std::max(0.0f, Nh.z)));
+    }
+
+    // Exact Smith masking term of GGX, the one the visible normals are drawn with
+    float SmithG1GGX(float NdotV, float alpha)
+    {
+        float a2 = alpha * alpha;
+        return 2 * NdotV / (NdotV + std::sqrt(a2 + (1 - a2) * NdotV * NdotV));
+    }
+
+    // Chance that a Microfacet sample follows the specular lobe rather than the
+    // diffuse one, in proportion to the weight eval gives each
+    float specularProbability(const Vector3f &wi, const Vector3f &N)
+    {
+        float F;
+        fresnel(wi, N, ior, F);
+        float specular = F * (Ks.x + Ks.y + Ks.z);
+        float diffuse = (1.0f - F) * (Kd.x + Kd.y + Kd.z);
+        return specular + diffuse > 0 ? specular / (specular + diffuse) : 0.5f;
+    }
+
     float DistributionGGX(Vector3f N, Vector3f H, float roughness)
     {
         float a = roughness * roughness;
@@ -123,6 +180,7 @@ public:
     //Vector3f m_color;
     Vector3f m_emission;
     float ior;
+    float roughness;  // GGX roughness of Microfacet, squared to get alpha
     Vector3f Kd, Ks;
     float specularExponent;
     //Texture tex;
@@ -135,7 +193,7 @@ public:
     inline bool hasEmission();
 
     // sample a ray by Material properties
-    inline Vector3f sample(const Vector3f &wi, const Vector3f &N);
+    inline Vector3f sample(const Vector3f &wi, const Vector3f &N, Sampler &sampler);
     // given a ray, calculate the PdF of this ray
     inline float pdf(const Vector3f &wi, const Vector3f &wo, const Vector3f &N);
     // given a ray, calculate the contribution of this ray
@@ -147,6 +205,8 @@ Material::Material(MaterialType t, Vector3f e){
     m_type = t;
     //m_color = c;
     m_emission = e;
+    ior = 1.85f;
+    roughness = 0.35f;
 }
 
 MaterialType Material::getType(){return m_type;}
@@ -162,27 +222,26 @@ Vector3f Material::getColorAt(double u, double v) {
 }
 
 
-Vector3f Material::sample(const Vector3f& wi, const Vector3f& N) {
+Vector3f Material::sample(const Vector3f& wi, const Vector3f& N, Sampler& sampler) {
     switch (m_type) {
 	    case DIFFUSE:
 	    {
-	        // uniform sample on the hemisphere
-	        float x_1 = get_random_float(), x_2 = get_random_float();
-	        float z = std::fabs(1.0f - 2.0f * x_1);
-	        float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
-	        Vector3f localRay(r * std::cos(phi), r * std::sin(phi), z);
-	        return toWorld(localRay, N);
+	        // cosine-weighted sample on the hemisphere
+	        float x_1 = sampler.get1D(), x_2 = sampler.get1D();
+	        return toWorld(sampleCosineHemisphere(x_1, x_2), N);
 
 	        break;
 	    }
 	    case Microfacet:
 	    {
-	        // uniform sample on the hemisphere
-	        float x_1 = get_random_float(), x_2 = get_random_float();
-	        float z = std::fabs(1.0f - 2.0f * x_1);
-	        float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
-	        Vector3f localRay(r * std::cos(phi), r * std::sin(phi), z);
-	        return toWorld(localRay, N);
+	        // pick a lobe, then reflect about a visible GGX normal or
+	        // sample the diffuse part by cosine
+	        float x_0 = sampler.get1D(), x_1 = sampler.get1D(), x_2 = sampler.get1D();
+	        Vector3f V = toLocal(-wi, N);
+	        if (V.z <= 0.0f || x_0 >= specularProbability(wi, N))
+	            return toWorld(sampleCosineHemisphere(x_1, x_2), N);
+	        Vector3f H = sampleGGXVNDF(V, roughness * roughness, x_1, x_2);
+	        return toWorld(2 * dotProduct(V, H) * H - V, N);
 
 	        break;
 	    }
@@ -193,20 +252,31 @@ float Material::pdf(const Vector3f& wi, const Vector3f& wo, const Vector3f& N) {
     switch (m_type) {
 	    case DIFFUSE:
 	    {
-	        // uniform sample probability 1 / (2 * PI)
-	        if (dotProduct(wo, N) > 0.0f)
-	            return 0.5f / M_PI;
+	        // cosine sample probability cos / PI
+	        float cosalpha = dotProduct(wo, N);
+	        if (cosalpha > 0.0f)
+	            return cosalpha / M_PI;
 	        else
 	            return 0.0f;
 	        break;
 	    }
 	    case Microfacet:
 	    {
-	        // uniform sample probability 1 / (2 * PI)
-	        if (dotProduct(wo, N) > 0.0f)
-	            return 0.5f / M_PI;
-	        else
+	        // mixture of the two lobes sample() draws from
+	        float cosalpha = dotProduct(wo, N);
+	        if (cosalpha <= 0.0f)
 	            return 0.0f;
+	        float pdfDiffuse = cosalpha / M_PI;
+	        float NdotV = dotProduct(-wi, N);
+	        if (NdotV <= 0.0f)
+	            return pdfDiffuse;
+	        // visible normal pdf D * G1 * (V.H) / (N.V), times the 1 / (4 V.H)
+	        // Jacobian of the reflection
+	        Vector3f H = normalize(wo - wi);
+	        float D = DistributionGGX(N, H, roughness);
+	        float pdfSpecular = D * SmithG1GGX(NdotV, roughness * roughness) / (4 * NdotV);
+	        float ps = specularProbability(wi, N);
+	        return ps * pdfSpecular + (1 - ps) * pdfDiffuse;
 	        break;
 	    }
     }
@@ -232,8 +302,6 @@ Vector3f Material::eval(const Vector3f& wi, const Vector3f& wo, const Vector3f&
 	        // Disney PBR 
 	        float cosalpha = dotProduct(N, wo);
 	        if (cosalpha > 0.0f) {
-	            float roughness = 0.35;
-
 	            Vector3f V = -wi;
 	            Vector3f L = wo;
 	            Vector3f H = normalize(V + L);
@@ -246,8 +314,7 @@ Vector3f Material::eval(const Vector3f& wi, const Vector3f& wo, const Vector3f&
 
 	            // fresnel term: F
 	            float F;
-	            float etat = 1.85;
-	            fresnel(wi, N, etat, F);
+	            fresnel(wi, N, ior, F);
 
 	            Vector3f nominator = D * G * F;
 	            float denominator = 4 * std::max(dotProduct(N, V), 0.0f) * std::max(dotProduct(N, L), 0.0f);
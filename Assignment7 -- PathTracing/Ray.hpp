@@ -26,4 +26,45 @@ struct Ray{
         return os;
     }
 };
+
+// Rays traced through the BVH together, one per SIMD lane: a packet of
+// neighbouring camera rays or of their shadow rays visits nearly the same
+// nodes, so the box tests of a node are done for every ray at once. Lanes
+// whose bit is clear in active hold no ray.
+constexpr int kPacketSize = 8;
+struct alignas(32) RayPacket {
+    float ox[kPacketSize], oy[kPacketSize], oz[kPacketSize];
+    float dx[kPacketSize], dy[kPacketSize], dz[kPacketSize];
+    float invDx[kPacketSize], invDy[kPacketSize], invDz[kPacketSize];
+    float tMax[kPacketSize];
+    int active = 0;
+
+    RayPacket()
+    {
+        for (int i = 0; i < kPacketSize; ++i) {
+            ox[i] = oy[i] = oz[i] = 0;
+            dx[i] = dy[i] = dz[i] = 1;
+            invDx[i] = invDy[i] = invDz[i] = 1;
+            tMax[i] = 0;
+        }
+    }
+
+    void set(int lane, const Ray& ray)
+    {
+        ox[lane] = ray.origin.x; oy[lane] = ray.origin.y; oz[lane] = ray.origin.z;
+        dx[lane] = ray.direction.x; dy[lane] = ray.direction.y; dz[lane] = ray.direction.z;
+        invDx[lane] = ray.direction_inv.x; invDy[lane] = ray.direction_inv.y; invDz[lane] = ray.direction_inv.z;
+        tMax[lane] = ray.t_max < std::numeric_limits<float>::max() ? (float)ray.t_max
+                                                                   : std::numeric_limits<float>::infinity();
+        active |= 1 << lane;
+    }
+
+    Ray ray(int lane) const
+    {
+        Ray r(Vector3f(ox[lane], oy[lane], oz[lane]), Vector3f(dx[lane], dy[lane], dz[lane]));
+        if (tMax[lane] < std::numeric_limits<float>::infinity())
+            r.t_max = tMax[lane];
+        return r;
+    }
+};
 #endif //RAYTRACING_RAY_H
@@ -5,31 +5,125 @@
 #include <fstream>
 #include "Scene.hpp"
 #include "Renderer.hpp"
+#include "Wavefront.hpp"
 #include <thread>
 #include <mutex>
-
-std::mutex mutex_ins;
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <type_traits>
 
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
 const float EPSILON = 0.00001;
 
+// Running statistics of every pixel. The mean is the pixel value; the
+// variance of the luminance (Welford's algorithm) estimates its error.
+struct PixelStats {
+    int n = 0;
+    Vector3f mean;
+    float m2 = 0;
+    bool done = false;
+};
+
+static void savePPM(const std::string& filename, const std::vector<PixelStats>& pixelStats, int width, int height)
+{
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (!fp) {
+        std::cerr << "Cannot write " << filename << "\n";
+        return;
+    }
+    (void)fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    for (auto i = 0; i < height * width; ++i) {
+        static unsigned char color[3];
+        const Vector3f& c = pixelStats[i].mean;
+        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, c.x), 0.6f));
+        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, c.y), 0.6f));
+        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, c.z), 0.6f));
+        fwrite(color, 1, 3, fp);
+    }
+    fclose(fp);
+}
+
+// A checkpoint is this header followed by the PixelStats and then the
+// Sampler of every pixel, written as raw bytes
+struct CheckpointHeader {
+    char magic[4];
+    int32_t width, height;
+    uint64_t seed;
+};
+static_assert(std::is_trivially_copyable<PixelStats>::value && std::is_trivially_copyable<Sampler>::value,
+              "checkpoints copy pixel state byte for byte");
+static const char kCheckpointMagic[4] = {'P', 'T', 'C', '1'};
+
+static void saveCheckpoint(const std::string& filename, const std::vector<PixelStats>& pixelStats,
+                           const std::vector<Sampler>& samplers, int width, int height, uint64_t seed)
+{
+    // write a new file and rename it over the old one, so being killed while
+    // writing leaves the previous checkpoint intact
+    std::string tmpFilename = filename + ".tmp";
+    FILE* fp = fopen(tmpFilename.c_str(), "wb");
+    if (!fp) {
+        std::cerr << "Cannot write " << tmpFilename << "\n";
+        return;
+    }
+    CheckpointHeader header;
+    memcpy(header.magic, kCheckpointMagic, 4);
+    header.width = width;
+    header.height = height;
+    header.seed = seed;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(pixelStats.data(), sizeof(PixelStats), pixelStats.size(), fp) == pixelStats.size() &&
+              fwrite(samplers.data(), sizeof(Sampler), samplers.size(), fp) == samplers.size();
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || std::rename(tmpFilename.c_str(), filename.c_str()) != 0)
+        std::cerr << "Cannot write " << filename << "\n";
+}
+
+// Returns false and leaves the buffers alone if there is no checkpoint of
+// this image and seed
+static bool loadCheckpoint(const std::string& filename, std::vector<PixelStats>& pixelStats,
+                           std::vector<Sampler>& samplers, int width, int height, uint64_t seed)
+{
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (!fp)
+        return false;
+    CheckpointHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, kCheckpointMagic, 4) == 0 &&
+              header.width == width && header.height == height && header.seed == seed;
+    std::vector<PixelStats> loadedStats(pixelStats.size());
+    std::vector<Sampler> loadedSamplers(samplers.size());
+    ok = ok && fread(loadedStats.data(), sizeof(PixelStats), loadedStats.size(), fp) == loadedStats.size() &&
+         fread(loadedSamplers.data(), sizeof(Sampler), loadedSamplers.size(), fp) == loadedSamplers.size();
+    fclose(fp);
+    if (!ok) {
+        std::cerr << "Ignoring checkpoint " << filename << " of a different render\n";
+        return false;
+    }
+    pixelStats.swap(loadedStats);
+    samplers.swap(loadedSamplers);
+    return true;
+}
+
 // The main render function. This where we iterate over all pixels in the image,
 // generate primary rays and cast these rays into the scene. The content of the
 // framebuffer is saved to a file.
 void Renderer::Render(const Scene& scene)
 {
-    std::vector<Vector3f> framebuffer(scene.width * scene.height);
-
     float scale = tan(deg2rad(scene.fov * 0.5));
     float imageAspectRatio = scene.width / (float)scene.height;
     Vector3f eye_pos(278, 273, -800);
     int m = 0;
 
-    // change the spp value to change sample amount
-    int spp = 256;
-    std::cout << "SPP: " << spp << "\n";
+    if (adaptive)
+        std::cout << "SPP: " << std::min(minSpp, spp) << " - " << spp << " (adaptive)\n";
+    else if (progressive)
+        std::cout << "SPP: 1 - " << spp << " (progressive)\n";
+    else
+        std::cout << "SPP: " << spp << "\n";
 #pragma region single-thread version
     //for (uint32_t j = 0; j < scene.height; ++j) {
     //    for (uint32_t i = 0; i < scene.width; ++i) {
@@ -48,66 +142,314 @@ void Renderer::Render(const Scene& scene)
     //}
 #pragma endregion
 #pragma region multi-thread version
-    //for displaying process percentage
-    int process = 0;
+    const int nPixels = scene.width * scene.height;
+    std::vector<PixelStats> pixelStats(nPixels);
+    // each pixel keeps its own sequence across passes, so the image depends
+    // only on the seed and the number of samples every pixel took
+    std::vector<Sampler> samplers;
+    samplers.reserve(nPixels);
+    for (int i = 0; i < nPixels; ++i)
+        samplers.emplace_back(i, seed);
+    uint64_t resumedSamples = 0;
+    if (resume && !checkpointFile.empty() &&
+        loadCheckpoint(checkpointFile, pixelStats, samplers, scene.width, scene.height, seed)) {
+        // the first pass decides again which pixels are done, since spp or
+        // the error threshold may have changed since the checkpoint
+        for (PixelStats& ps : pixelStats) {
+            resumedSamples += ps.n;
+            ps.done = false;
+        }
+        std::cout << "Resuming from " << checkpointFile << " at " << (double)resumedSamples / nPixels << " SPP\n";
+    }
+
+    // Workers only bump these counters. A single reporter thread samples them
+    // to draw the progress bar, so rendering never waits on the console.
+    std::atomic<uint64_t> pixelsDone{0}, samplesDone{0}, raysDone{0};
+    auto startTime = std::chrono::steady_clock::now();
+    auto elapsed = [&]() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    };
+    auto sampleStats = [&]() {
+        RenderStats s;
+        s.elapsedSeconds = elapsed();
+        s.pixels = pixelsDone.load(std::memory_order_relaxed);
+        s.samples = samplesDone.load(std::memory_order_relaxed);
+        s.rays = raysDone.load(std::memory_order_relaxed);
+        // an adaptive render usually finishes before every pixel reaches spp
+        s.progress = std::min(1.0f, (float)(resumedSamples + s.samples) / ((float)nPixels * spp));
+        if (s.elapsedSeconds > 0) {
+            s.samplesPerSecond = s.samples / s.elapsedSeconds;
+            s.raysPerSecond = s.rays / s.elapsedSeconds;
+        }
+        if (s.progress > 0)
+            s.etaSeconds = s.elapsedSeconds * (1 - s.progress) / s.progress;
+        return s;
+    };
+    auto reportProgress = [](const RenderStats& s) {
+        char info[96];
+        snprintf(info, sizeof(info), "%.2f Mrays/s %.2f Msamples/s ETA %ds   ",
+                 s.raysPerSecond * 1e-6, s.samplesPerSecond * 1e-6, (int)s.etaSeconds);
+        UpdateProgress(s.progress, info);
+    };
+    // the reporter also watches the clock, so that workers can drop the rest
+    // of a pass once the time budget is spent
+    std::atomic<bool> outOfTime{false};
+    std::mutex reporterMutex;
+    std::condition_variable reporterWake;
+    bool finished = false;
+    std::thread reporter([&]() {
+        std::unique_lock<std::mutex> lock(reporterMutex);
+        while (!reporterWake.wait_for(lock, std::chrono::milliseconds(progressIntervalMs), [&] { return finished; })) {
+            RenderStats s = sampleStats();
+            if (timeBudgetSeconds > 0 && s.elapsedSeconds >= timeBudgetSeconds)
+                outOfTime = true;
+            reportProgress(s);
+        }
+    });
+
+    // Every unfinished pixel is brought up to passTarget samples, or takes
+    // passTarget more in the batches of an adaptive render
+    int passTarget = adaptive ? std::min(minSpp, spp) : progressive ? 1 : spp;
+    bool passAddsBatch = false;
+    int passIndex = 0;
+
+    // generate primary ray direction
+    auto cameraDir = [&](uint32_t i, uint32_t j) {
+        float x = (2 * (i + 0.5) / (float)scene.width - 1) *
+            imageAspectRatio * scale;
+        float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
+        return normalize(Vector3f(-x, y, 1));
+    };
+    // samples pixel ps takes in this pass; once the first pass has given
+    // every pixel a value, running out of time drops whatever is left of it
+    auto passSamples = [&](const PixelStats& ps) {
+        if (ps.done || (passIndex > 0 && outOfTime.load(std::memory_order_relaxed)))
+            return -1;
+        return std::max(0, std::min(passAddsBatch ? ps.n + passTarget : passTarget, spp) - ps.n);
+    };
+    auto addSample = [](PixelStats& ps, const Vector3f& L) {
+        float lum = (L.x + L.y + L.z) / 3;
+        float meanLum = (ps.mean.x + ps.mean.y + ps.mean.z) / 3;
+        ps.n++;
+        ps.mean += (L - ps.mean) / ps.n;
+        ps.m2 += (lum - meanLum) * (lum - (ps.mean.x + ps.mean.y + ps.mean.z) / 3);
+    };
+    auto finishPixel = [&](PixelStats& ps, int k) {
+        // a pixel is done at spp samples or, when adaptive, once the
+        // standard error of its mean is small relative to the mean
+        if (ps.n >= spp)
+            ps.done = true;
+        else if (adaptive && ps.n > 1) {
+            float meanLum = (ps.mean.x + ps.mean.y + ps.mean.z) / 3;
+            float stdError = std::sqrt(ps.m2 / (ps.n - 1) / ps.n);
+            ps.done = stdError <= errorThreshold * std::max(meanLum, 0.01f);
+        }
+        samplesDone.fetch_add(k, std::memory_order_relaxed);
+        if (ps.done)
+            pixelsDone.fetch_add(1, std::memory_order_relaxed);
+    };
 
-    // lambda function
+    // sample the unfinished pixels of [colStart, colEnd) x [rowStart, rowEnd)
     auto generateRayMultiThreading = [&](uint32_t rowStart, uint32_t rowEnd, uint32_t colStart, uint32_t colEnd)
     {
         for (uint32_t j = rowStart; j < rowEnd; ++j) {
             int m = j * scene.width + colStart;
-            for (uint32_t i = colStart; i < colEnd; ++i) {
-                // generate primary ray direction
-                float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-                    imageAspectRatio * scale;
-                float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-
-                Vector3f dir = normalize(Vector3f(-x, y, 1));
-                for (int k = 0; k < spp; k++) {
-                    framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / spp;
-                }
-                m++;
-                process++;
+            for (uint32_t i = colStart; i < colEnd; ++i, ++m) {
+                PixelStats& ps = pixelStats[m];
+                int k = passSamples(ps);
+                if (k < 0)
+                    continue;
+                Vector3f dir = cameraDir(i, j);
+                Sampler& sampler = samplers[m];
+                uint64_t raysBefore = Scene::raysTraced;
+                for (int s = 0; s < k; s++)
+                    addSample(ps, scene.castRay(Ray(eye_pos, dir), 0, sampler));
+                raysDone.fetch_add(Scene::raysTraced - raysBefore, std::memory_order_relaxed);
+                finishPixel(ps, k);
             }
+        }
+    };
 
-            // mutex lock for displaying process percentage
-            std::lock_guard<std::mutex> g1(mutex_ins);
-            UpdateProgress(1.0 * process / scene.width / scene.height);
+    // The same for the wavefront integrator: all samples the tile takes in
+    // this pass are traced together, wavefrontBatch paths at a time. Every
+    // sample draws from its own sequence, since the samples of a pixel are
+    // traced side by side rather than one after another.
+    auto generateRayWavefront = [&](WavefrontIntegrator& integrator, uint32_t rowStart, uint32_t rowEnd,
+                                    uint32_t colStart, uint32_t colEnd)
+    {
+        struct Job {
+            int pixel, sample;
+        };
+        std::vector<Job> jobs;
+        std::vector<int> tilePixels, tileSamples;
+        int maxSamples = 0;
+        for (uint32_t j = rowStart; j < rowEnd; ++j) {
+            int m = j * scene.width + colStart;
+            for (uint32_t i = colStart; i < colEnd; ++i, ++m) {
+                int k = passSamples(pixelStats[m]);
+                if (k < 0)
+                    continue;
+                tilePixels.push_back(m);
+                tileSamples.push_back(k);
+                maxSamples = std::max(maxSamples, k);
+                if (!packets)
+                    for (int s = 0; s < k; s++)
+                        jobs.push_back({m, pixelStats[m].n + s});
+            }
         }
+        if (packets) {
+            // one sample of every pixel of a 4x2 block after the other, so
+            // that each packet holds the camera rays of a block
+            uint32_t tileWidth = colEnd - colStart;
+            std::vector<int> samplesOf((rowEnd - rowStart) * tileWidth, 0);
+            for (size_t t = 0; t < tilePixels.size(); ++t)
+                samplesOf[(tilePixels[t] / scene.width - rowStart) * tileWidth +
+                          tilePixels[t] % scene.width - colStart] = tileSamples[t];
+            for (int s = 0; s < maxSamples; s++)
+                for (uint32_t j0 = rowStart; j0 < rowEnd; j0 += 2)
+                    for (uint32_t i0 = colStart; i0 < colEnd; i0 += 4)
+                        for (int lane = 0; lane < kPacketSize; ++lane) {
+                            uint32_t i = i0 + lane % 4, j = j0 + lane / 4;
+                            if (i >= colEnd || j >= rowEnd || samplesOf[(j - rowStart) * tileWidth + i - colStart] <= s)
+                                continue;
+                            int m = j * scene.width + i;
+                            jobs.push_back({m, pixelStats[m].n + s});
+                        }
+        }
+
+        uint64_t raysBefore = Scene::raysTraced;
+        std::vector<Vector3f> radiance;
+        for (size_t first = 0; first < jobs.size(); first += wavefrontBatch) {
+            size_t last = std::min(jobs.size(), first + (size_t)wavefrontBatch);
+            for (size_t q = first; q < last; ++q) {
+                const Job& job = jobs[q];
+                Vector3f dir = cameraDir(job.pixel % scene.width, job.pixel / scene.width);
+                integrator.addCameraRay(eye_pos, dir, Sampler((uint64_t)job.sample * nPixels + job.pixel, seed));
+            }
+            integrator.trace(radiance);
+            // the jobs of every pixel are in sample order, so it adds its
+            // samples in the same order on any batch size
+            for (size_t q = first; q < last; ++q)
+                addSample(pixelStats[jobs[q].pixel], radiance[q - first]);
+        }
+        raysDone.fetch_add(Scene::raysTraced - raysBefore, std::memory_order_relaxed);
+        for (size_t t = 0; t < tilePixels.size(); ++t)
+            finishPixel(pixelStats[tilePixels[t]], tileSamples[t]);
     };
-    int id = 0;
-    // division nums for col and row
-    constexpr int bx = 5;
-    constexpr int by = 5;
-    std::thread th[bx * by];
 
-    int strideX = (scene.width + 1) / bx;
-    int strideY = (scene.height + 1) / by;
+    // Cut the image into tiles and deal them round-robin to one queue per
+    // thread. A thread renders tiles from the front of its own queue and, once
+    // that is empty, steals from the back of the others, so threads that got
+    // cheap tiles keep helping until the whole image is done.
+    struct Tile {
+        int rowStart, rowEnd, colStart, colEnd;
+    };
+    struct TileQueue {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+    int nThreads = numThreads > 0 ? numThreads : std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<TileQueue> queues(nThreads);
 
-    // generate Ray in one thread for each subarea
-    for (int i = 0; i < scene.height; i += strideX)
-    {
-        for (int j = 0; j < scene.width; j += strideY)
-        {
-            th[id] = std::thread(generateRayMultiThreading, i, std::min(i + strideX, scene.height), j, std::min(j + strideY, scene.width));
-            ++id;
+    auto nextTile = [&](int id, Tile& tile) {
+        for (int k = 0; k < nThreads; ++k) {
+            TileQueue& queue = queues[(id + k) % nThreads];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tiles.empty())
+                continue;
+            if (k == 0) {
+                tile = queue.tiles.front();
+                queue.tiles.pop_front();
+            }
+            else {
+                tile = queue.tiles.back();
+                queue.tiles.pop_back();
+            }
+            return true;
+        }
+        return false;
+    };
+
+    auto renderPass = [&]() {
+        int nTiles = 0;
+        for (int i = 0; i < scene.height; i += tileSize)
+            for (int j = 0; j < scene.width; j += tileSize)
+                queues[nTiles++ % nThreads].tiles.push_back(
+                    {i, std::min(i + tileSize, scene.height), j, std::min(j + tileSize, scene.width)});
+
+        std::vector<std::thread> th;
+        for (int id = 0; id < nThreads; ++id) {
+            th.emplace_back([&, id]() {
+                Tile tile;
+                if (wavefront) {
+                    WavefrontIntegrator integrator(scene);
+                    integrator.usePackets = packets;
+                    while (nextTile(id, tile))
+                        generateRayWavefront(integrator, tile.rowStart, tile.rowEnd, tile.colStart, tile.colEnd);
+                }
+                else {
+                    while (nextTile(id, tile))
+                        generateRayMultiThreading(tile.rowStart, tile.rowEnd, tile.colStart, tile.colEnd);
+                }
+            });
+        }
+        for (auto& t : th) t.join();
+    };
+
+    // A fixed render is a single pass of spp samples. A progressive render
+    // doubles the samples of every pixel with each pass, 1, 2, 4, ... up to
+    // spp, and writes the image after each one. An adaptive render starts
+    // with minSpp samples everywhere, then keeps adding adaptiveBatch samples
+    // to the pixels that are not done yet. Either stops early when the sample
+    // or time budget runs out.
+    double lastCheckpoint = 0;
+    while (pixelsDone.load() < (uint64_t)nPixels) {
+        uint64_t active = nPixels - pixelsDone.load();
+        if (passIndex > 0) {
+            if (adaptive) {
+                passTarget = adaptiveBatch;
+                passAddsBatch = true;
+            }
+            else {
+                passTarget *= 2;
+            }
+            if (sampleBudget > 0 && samplesDone.load() + active * passTarget > sampleBudget)
+                break;
+            if (outOfTime)
+                break;
+        }
+        uint64_t samplesBefore = samplesDone.load();
+        renderPass();
+        ++passIndex;
+        if (samplesDone.load() == samplesBefore)
+            continue;
+        if (progressive)
+            savePPM(outputFile, pixelStats, scene.width, scene.height);
+        if (!checkpointFile.empty() && elapsed() - lastCheckpoint >= checkpointIntervalSeconds) {
+            saveCheckpoint(checkpointFile, pixelStats, samplers, scene.width, scene.height, seed);
+            lastCheckpoint = elapsed();
         }
     }
 
-    for (int i = 0; i < bx * by; i++) th[i].join();
+    {
+        std::lock_guard<std::mutex> lock(reporterMutex);
+        finished = true;
+    }
+    reporterWake.notify_one();
+    reporter.join();
 #pragma endregion
 
-    UpdateProgress(1.f);
+    stats = sampleStats();
+    stats.pixels = nPixels;
+    stats.progress = 1;
+    stats.etaSeconds = 0;
+    reportProgress(stats);
+    if (adaptive || progressive || resumedSamples > 0)
+        std::cout << "\nAverage SPP: " << (double)(resumedSamples + stats.samples) / nPixels;
+    std::cout << "\n";
 
     // save framebuffer to file
-    FILE* fp = fopen("binary.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    for (auto i = 0; i < scene.height * scene.width; ++i) {
-        static unsigned char color[3];
-        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
-        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
-        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
-        fwrite(color, 1, 3, fp);
-    }
-    fclose(fp);    
+    savePPM(outputFile, pixelStats, scene.width, scene.height);
+    if (!checkpointFile.empty())
+        saveCheckpoint(checkpointFile, pixelStats, samplers, scene.width, scene.height, seed);
 }
@@ -2,6 +2,16 @@
 #include "Scene.hpp"
 
 
+// Render throughput, sampled by the progress reporter while rendering
+struct RenderStats
+{
+    float progress = 0;
+    double elapsedSeconds = 0;
+    uint64_t pixels = 0, samples = 0, rays = 0;
+    double samplesPerSecond = 0, raysPerSecond = 0;
+    double etaSeconds = 0;
+};
+
 struct hit_payload
 {
     float tNear;
@@ -15,5 +25,48 @@ class Renderer
 public:
     void Render(const Scene& scene);
 
+    // every pixel draws its random numbers from its own sequence of this seed
+    uint64_t seed = 0;
+    // change the spp value to change sample amount; the most any pixel
+    // takes when sampling adaptively
+    int spp = 256;
+    // Adaptive sampling: every pixel takes minSpp samples, then the pixels
+    // whose relative standard error is above errorThreshold get adaptiveBatch
+    // more at a time until they converge or reach spp
+    bool adaptive = false;
+    int minSpp = 16;
+    int adaptiveBatch = 16;
+    float errorThreshold = 0.02f;
+    // Progressive rendering: passes of 1, 1, 2, 4, ... samples per pixel up
+    // to spp, with the image written to outputFile after every pass
+    bool progressive = false;
+    // stop adding passes at this many samples in this run or once this many
+    // seconds have passed, 0 for no limit; the first pass always completes
+    uint64_t sampleBudget = 0;
+    double timeBudgetSeconds = 0;
+    std::string outputFile = "binary.ppm";
+    // Pixel sums, sample counts and random states are saved here between
+    // passes, at most every checkpointIntervalSeconds, and at the end; with
+    // resume set, a render of the same size and seed continues from it.
+    // Empty to disable.
+    std::string checkpointFile;
+    double checkpointIntervalSeconds = 60;
+    bool resume = false;
+    // side length in pixels of the tiles handed out to render threads
+    int tileSize = 32;
+    // number of render threads, 0 uses every hardware thread
+    int numThreads = 0;
+    // trace each tile with the WavefrontIntegrator, at most wavefrontBatch
+    // paths at a time, instead of one path after another with castRay
+    bool wavefront = false;
+    int wavefrontBatch = 1 << 14;
+    // in wavefront mode, trace camera rays in packets of 4x2 pixels and
+    // their first shadow rays in packets as well
+    bool packets = false;
+    // how often the progress bar and statistics are refreshed
+    int progressIntervalMs = 500;
+    // statistics of the last call to Render
+    RenderStats stats;
+
 private:
 };
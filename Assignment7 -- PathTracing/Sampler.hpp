@@ -0,0 +1,49 @@
+//
+// Random number generation for the path tracer.
+//
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+
+// PCG32 generator (M.E. O'Neill, pcg-random.org): 16 bytes of state and a
+// handful of integer ops per number. Each render thread owns its sampler, so
+// nothing is shared between threads. The renderer starts a new sequence for
+// every pixel, so an image depends only on the seed and not on the thread
+// that rendered each pixel.
+class Sampler
+{
+public:
+    explicit Sampler(uint64_t sequenceIndex = 0, uint64_t seed = 0x853c49e6748fea9bULL)
+    {
+        setSequence(sequenceIndex, seed);
+    }
+
+    // Select one of 2^63 independent streams and its starting point
+    void setSequence(uint64_t sequenceIndex, uint64_t seed)
+    {
+        state = 0u;
+        inc = (sequenceIndex << 1u) | 1u;
+        nextUInt();
+        state += seed;
+        nextUInt();
+    }
+
+    uint32_t nextUInt()
+    {
+        uint64_t oldState = state;
+        state = oldState * 6364136223846793005ULL + inc;
+        uint32_t xorShifted = (uint32_t)(((oldState >> 18u) ^ oldState) >> 27u);
+        uint32_t rot = (uint32_t)(oldState >> 59u);
+        return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31));
+    }
+
+    // Uniform float in [0, 1)
+    float get1D()
+    {
+        return std::min(nextUInt() * 0x1p-32f, 0x1.fffffep-1f);
+    }
+
+private:
+    uint64_t state, inc;
+};
@@ -5,40 +5,97 @@
 #include "Scene.hpp"
 
 
-void Scene::buildBVH() {
+void Scene::buildBVH(BVHAccel::SplitMethod splitMethod) {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh = new BVHAccel(objects, 1, splitMethod);
+    buildLightSampler();
 }
 
 void Scene::buildSAH() {
     printf(" - Generating SAH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::SAH);
+    buildLightSampler();
 }
 
+void Scene::buildLightSampler() {
+    emitters.clear();
+    emitterArea = 0;
+    std::vector<float> areas;
+    for (Object* object : objects) {
+        if (object->hasEmit()) {
+            emitters.push_back(object);
+            areas.push_back(object->getArea());
+            emitterArea += object->getArea();
+        }
+    }
+    emitterTable = AliasTable(areas);
+
+    if (useLightBVH) {
+        // the light BVH works on single triangles rather than whole meshes
+        std::vector<Object*> lightPrims;
+        for (Object* object : objects)
+            object->getEmitters(lightPrims);
+        lightBVH = LightBVH(lightPrims);
+    }
+}
+
+thread_local uint64_t Scene::raysTraced = 0;
+
 Intersection Scene::intersect(const Ray &ray) const
 {
+    ++raysTraced;
     return this->bvh->Intersect(ray);
 }
 
-void Scene::sampleLight(Intersection &pos, float &pdf) const
+bool Scene::intersectP(const Ray &ray) const
 {
-    float emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
+    ++raysTraced;
+    return this->bvh->IntersectP(ray);
+}
+
+void Scene::intersectPacket(RayPacket &packet, Intersection *isect) const
+{
+    raysTraced += __builtin_popcount(packet.active);
+    this->bvh->IntersectPacket(packet, packet.active, isect);
+}
+
+int Scene::intersectPacketP(const RayPacket &packet) const
+{
+    raysTraced += __builtin_popcount(packet.active);
+    return this->bvh->IntersectPacketP(packet, packet.active);
+}
+
+void Scene::sampleLight(const Intersection &ref, Intersection &pos, float &pdf, Sampler &sampler) const
+{
+    if (useLightBVH && !lightBVH.empty()) {
+        // pick an emitter by its estimated contribution to ref
+        float pmf;
+        Object* emitter = lightBVH.sample(ref.coords, ref.normal, sampler.get1D(), pmf);
+        if (!emitter) {
+            pdf = 0;
+            return;
         }
+        emitter->Sample(pos, pdf, sampler);
+        pdf *= pmf;
+        return;
     }
-    float p = get_random_float() * emit_area_sum;
-    emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-            if (p <= emit_area_sum){
-                objects[k]->Sample(pos, pdf);
-                break;
-            }
-        }
+    if (emitterTable.empty()) {
+        pdf = 0;
+        return;
     }
+    // pick an emitter in proportion to its area, then a point on it
+    float pmf;
+    Object* emitter = emitters[emitterTable.sample(sampler.get1D(), &pmf)];
+    emitter->Sample(pos, pdf, sampler);
+    pdf *= pmf;
+}
+
+float Scene::pdfLight(const Intersection &ref, const Intersection &lightPoint) const
+{
+    if (useLightBVH && !lightBVH.empty())
+        return lightBVH.pmf(ref.coords, ref.normal, lightPoint.obj) / lightPoint.obj->getArea();
+    // emitters and their triangles are picked by area
+    return emitterArea > 0 ? 1 / emitterArea : 0;
 }
 
 bool Scene::trace(
@@ -106,26 +163,34 @@ bool Scene::trace(
 //    }
 //    return Vector3f(0, 0, 0);
 //}
-Vector3f Scene::castRay(const Ray& ray, int depth) const
+// Iterative path tracing: each bounce adds its direct lighting weighted by the
+// throughput of the path so far, then continues along one sampled direction.
+// The ray of every bounce is intersected exactly once. Direct light comes
+// from both a light sample and the BSDF sample, combined by multiple
+// importance sampling.
+Vector3f Scene::castRay(const Ray& ray, int depth, Sampler& sampler) const
 {
+	Vector3f L(0, 0, 0);
+	// product of f_r * cos / pdf / RussianRoulette along the path
+	Vector3f throughput(1, 1, 1);
+	Vector3f wo = ray.direction;
 	Intersection inter = intersect(ray);
 
-	if (inter.happened)
+	for (; inter.happened; ++depth)
 	{
 		if (inter.m->hasEmission())
 		{
+			// lights reached by a bounce are counted when the bounce is sampled
 			if (depth == 0)
 			{
-				return inter.m->getEmission();
+				L += inter.m->getEmission();
 			}
-			else return Vector3f(0, 0, 0);
+			break;
 		}
-		Vector3f L_dir(0, 0, 0);
-		Vector3f L_indir(0, 0, 0);
 #pragma region Light_direct
 		Intersection lightInter;
 		float pdf_light = 0.0f;
-		sampleLight(lightInter, pdf_light);
+		sampleLight(inter, lightInter, pdf_light, sampler);
 
 		// object surface normal
 		auto& N = inter.normal;
@@ -139,32 +204,52 @@ Vector3f Scene::castRay(const Ray& ray, int depth) const
 		auto lightDir = diff.normalized();
 		float lightDistance = diff.x * diff.x + diff.y * diff.y + diff.z * diff.z;
 
+		// The light sample is visible unless something blocks the segment
+		// in front of it
 		Ray light(objPos, lightDir);
-		Intersection light2obj = intersect(light);
+		light.t_max = std::sqrt(lightDistance) - 1e-2;
 
-		if (light2obj.happened && (light2obj.coords - lightPos).norm() < 1e-2)
+		if (pdf_light > 0 && dotProduct(-lightDir, NN) > 0 && !intersectP(light))
 		{
-			Vector3f f_r = inter.m->eval(ray.direction, lightDir, N);
-			L_dir = lightInter.emit * f_r * dotProduct(lightDir, N) * dotProduct(-lightDir, NN) / lightDistance / pdf_light;
+			Vector3f f_r = inter.m->eval(wo, lightDir, N);
+			float pdf_light_w = pdf_light * lightDistance / dotProduct(-lightDir, NN);
+			float weight = powerHeuristic(pdf_light_w, inter.m->pdf(wo, lightDir, N));
+			L += throughput * lightInter.emit * f_r * dotProduct(lightDir, N) / pdf_light_w * weight;
 		}
 #pragma endregion
 #pragma region Light_indirect
-		if (get_random_float() < RussianRoulette)
+		if (sampler.get1D() >= RussianRoulette)
+			break;
+
+		Vector3f nextDir = inter.m->sample(wo, N, sampler).normalized();
+		// a microfacet reflection can leave below the surface and carries nothing
+		float pdf = inter.m->pdf(wo, nextDir, N);
+		if (pdf <= 0.0f)
+			break;
+		Ray nextRay(objPos, nextDir);
+		Intersection nextInter = intersect(nextRay);
+		if (!nextInter.happened)
+			break;
+
+		Vector3f f_r = inter.m->eval(wo, nextDir, N);
+		throughput = throughput * f_r * dotProduct(nextDir, N) / pdf / RussianRoulette;
+
+		// The BSDF sample found a light: add it, weighted against the chance
+		// that light sampling picks the same point
+		if (nextInter.m->hasEmission())
 		{
-			Vector3f nextDir = inter.m->sample(ray.direction, N).normalized();
-
-			Ray nextRay(objPos, nextDir);
-			Intersection nextInter = intersect(nextRay);
-			if (nextInter.happened && !nextInter.m->hasEmission())
+			float cosLight = dotProduct(-nextDir, nextInter.normal);
+			if (cosLight > 0)
 			{
-				float pdf = inter.m->pdf(ray.direction, nextDir, N);
-				Vector3f f_r = inter.m->eval(ray.direction, nextDir, N);
-				L_indir = castRay(nextRay, depth + 1) * f_r * dotProduct(nextDir, N) / pdf / RussianRoulette;
+				float pdf_light_w = pdfLight(inter, nextInter) * nextInter.distance * nextInter.distance / cosLight;
+				L += throughput * nextInter.m->getEmission() * powerHeuristic(pdf, pdf_light_w);
 			}
+			break;
 		}
+		wo = nextDir;
+		inter = nextInter;
 #pragma endregion
-		return L_dir + L_indir;
 	}
 
-	return Vector3f(0, 0, 0);
-}
\ No newline at end of file
+	return L;
+}
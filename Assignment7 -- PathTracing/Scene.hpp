@@ -10,6 +10,7 @@
 #include "Light.hpp"
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "AliasTable.hpp"
 #include "Ray.hpp"
 
 
@@ -33,11 +34,23 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
+    bool intersectP(const Ray& ray) const;
+    // intersect and intersectP for every active ray of a packet; isect has
+    // kPacketSize entries, intersectPacketP returns the mask of blocked rays
+    void intersectPacket(RayPacket& packet, Intersection* isect) const;
+    int intersectPacketP(const RayPacket& packet) const;
+    // rays traced by the calling thread through intersect/intersectP
+    static thread_local uint64_t raysTraced;
     BVHAccel *bvh;
-    void buildBVH();
+    void buildBVH(BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::NAIVE);
     void buildSAH();
-    Vector3f castRay(const Ray &ray, int depth) const;
-    void sampleLight(Intersection &pos, float &pdf) const;
+    // build the light samplers, called after the BVH is built
+    void buildLightSampler();
+    Vector3f castRay(const Ray &ray, int depth, Sampler &sampler) const;
+    // sample a point on an emitter to light ref, pdf is per unit area
+    void sampleLight(const Intersection &ref, Intersection &pos, float &pdf, Sampler &sampler) const;
+    // pdf per unit area of sampleLight choosing lightPoint
+    float pdfLight(const Intersection &ref, const Intersection &lightPoint) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
@@ -47,6 +60,14 @@ public:
     // creating the scene (adding objects and lights)
     std::vector<Object* > objects;
     std::vector<std::unique_ptr<Light> > lights;
+    // emissive objects, sampled in proportion to their area
+    std::vector<Object*> emitters;
+    AliasTable emitterTable;
+    float emitterArea = 0;
+    // sample lights by their estimated contribution instead of by area;
+    // takes effect at the next buildBVH
+    bool useLightBVH = false;
+    LightBVH lightBVH;
 
     // Compute reflection direction
     Vector3f reflect(const Vector3f &I, const Vector3f &N) const
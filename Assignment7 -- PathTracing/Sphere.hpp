@@ -10,6 +10,65 @@
 #include "Bounds3.hpp"
 #include "Material.hpp"
 
+// Analytic ray-sphere test: the nearer root of the quadratic that lies in
+// front of the ray origin, negative if there is none
+inline float intersectSphere(const Ray& ray, const Vector3f& center, float radius2)
+{
+    Vector3f L = ray.origin - center;
+    float a = dotProduct(ray.direction, ray.direction);
+    float b = 2 * dotProduct(ray.direction, L);
+    float c = dotProduct(L, L) - radius2;
+    float t0, t1;
+    if (!solveQuadratic(a, b, c, t0, t1)) return -1;
+    if (t0 < 0) t0 = t1;
+    return t0;
+}
+
+// What a BVH stores of a Sphere to test it without a virtual call
+struct SphereShape
+{
+    Vector3f center;
+    float radius2;
+    Material* m;
+    Object* object;
+
+    // Replace isect by the hit of ray if there is one nearer
+    bool intersect(const Ray& ray, Intersection& isect) const
+    {
+        float t = floatDistance(isect.distance);
+        if (!intersect(ray, t))
+            return false;
+        interaction(ray, t, isect);
+        return true;
+    }
+    // Replace t by the distance of the hit of ray if it is nearer
+    bool intersect(const Ray& ray, float& t) const
+    {
+        float t0 = intersectSphere(ray, center, radius2);
+        // fixup for intersection judgement, as in Sphere::getIntersection
+        if (!(t0 > 0.5) || t0 >= t)
+            return false;
+        t = t0;
+        return true;
+    }
+    // The Intersection of the hit of ray at distance t
+    void interaction(const Ray& ray, float t, Intersection& isect) const
+    {
+        isect.happened = true;
+        isect.coords = Vector3f(ray.origin + ray.direction * t);
+        isect.normal = normalize(Vector3f(isect.coords - center));
+        isect.m = m;
+        isect.emit = m->getEmission();
+        isect.obj = object;
+        isect.distance = t;
+    }
+    bool intersectP(const Ray& ray) const
+    {
+        float t0 = intersectSphere(ray, center, radius2);
+        return t0 > 0.5 && t0 < ray.t_max;
+    }
+};
+
 class Sphere : public Object{
 public:
     Vector3f center;
@@ -19,28 +78,14 @@ public:
     Sphere(const Vector3f &c, const float &r, Material* mt = new Material()) : center(c), radius(r), radius2(r * r), m(mt), area(4 * M_PI *r *r) {}
     bool intersect(const Ray& ray) {
         // analytic solution
-        Vector3f L = ray.origin - center;
-        float a = dotProduct(ray.direction, ray.direction);
-        float b = 2 * dotProduct(ray.direction, L);
-        float c = dotProduct(L, L) - radius2;
-        float t0, t1;
-        float area = 4 * M_PI * radius2;
-        if (!solveQuadratic(a, b, c, t0, t1)) return false;
-        if (t0 < 0) t0 = t1;
-        if (t0 < 0) return false;
-        return true;
+        float t0 = intersectSphere(ray, center, radius2);
+        // same fixup for self-intersection as getIntersection
+        return t0 > 0.5 && t0 < ray.t_max;
     }
     bool intersect(const Ray& ray, float &tnear, uint32_t &index) const
     {
         // analytic solution
-        Vector3f L = ray.origin - center;
-        float a = dotProduct(ray.direction, ray.direction);
-        float b = 2 * dotProduct(ray.direction, L);
-        float c = dotProduct(L, L) - radius2;
-        float t0, t1;
-        if (!
-        solveQuadratic(a, b, c, t0, t1)) return false;
-        if (t0 < 0) t0 = t1;
+        float t0 = intersectSphere(ray, center, radius2);
         if (t0 < 0) return false;
         tnear = t0;
 
@@ -49,13 +94,7 @@ public:
     Intersection getIntersection(Ray ray) {
         Intersection result;
         result.happened = false;
-        Vector3f L = ray.origin - center;
-        float a = dotProduct(ray.direction, ray.direction);
-        float b = 2 * dotProduct(ray.direction, L);
-        float c = dotProduct(L, L) - radius2;
-        float t0, t1;
-        if (!solveQuadratic(a, b, c, t0, t1)) return result;
-        if (t0 < 0) t0 = t1;
+        float t0 = intersectSphere(ray, center, radius2);
         if (t0 < 0) return result;
 
         // fixup for intersection judgement
@@ -71,6 +110,8 @@ public:
         return result;
 
     }
+    PrimitiveType primitiveType() const { return PrimitiveType::Sphere; }
+    SphereShape shape() { return {center, radius2, m, this}; }
 
     Vector3f evalDiffuseColor(const Vector2f& st)const {
         //return m->getColor();
@@ -84,9 +125,11 @@ public:
         return Bounds3(Vector3f(center.x-radius, center.y-radius, center.z-radius),
                        Vector3f(center.x+radius, center.y+radius, center.z+radius));
     }
-    void Sample(Intersection &pos, float &pdf){
-        float theta = 2.0 * M_PI * get_random_float(), phi = M_PI * get_random_float();
-        Vector3f dir(std::cos(phi), std::sin(phi)*std::cos(theta), std::sin(phi)*std::sin(theta));
+    void Sample(Intersection &pos, float &pdf, Sampler &sampler){
+        // uniform over the surface, so that the pdf really is 1 / area
+        float z = 1.0f - 2.0f * sampler.get1D(), phi = 2.0 * M_PI * sampler.get1D();
+        float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+        Vector3f dir(r * std::cos(phi), r * std::sin(phi), z);
         pos.coords = center + radius * dir;
         pos.normal = dir;
         pos.emit = m->getEmission();
@@ -98,6 +141,11 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    LightBounds getLightBounds(){
+        // emits in every direction from its surface
+        Vector3f e = m->getEmission();
+        return LightBounds(getBounds(), Vector3f(0, 0, 1), M_PI * area * (e.x + e.y + e.z) / 3, -1, 0);
+    }
 };
 
 
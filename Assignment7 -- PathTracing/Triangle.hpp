@@ -1,13 +1,16 @@
 #pragma once
 
+#include "AliasTable.hpp"
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
 #include "OBJ_Loader.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
+#include "TriangleMesh.hpp"
 #include <cassert>
 #include <array>
+#include <map>
 
 bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
@@ -62,6 +65,9 @@ public:
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
     Intersection getIntersection(Ray ray) override;
+    void getIntersectionPacket(RayPacket& packet, int mask, Intersection* isect) override;
+    int intersectPacket(const RayPacket& packet, int mask) override { return intersectLanes(packet, mask, nullptr); }
+    int intersectLanes(const RayPacket& packet, int mask, float* tHit) const;
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const override
@@ -72,10 +78,11 @@ public:
     }
     Vector3f evalDiffuseColor(const Vector2f&) const override;
     Bounds3 getBounds() override;
-    void Sample(Intersection &pos, float &pdf){
-        float x = std::sqrt(get_random_float()), y = get_random_float();
+    void Sample(Intersection &pos, float &pdf, Sampler &sampler){
+        float x = std::sqrt(sampler.get1D()), y = sampler.get1D();
         pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
         pos.normal = this->normal;
+        if (m) pos.emit = m->getEmission();
         pdf = 1.0f / area;
     }
     float getArea(){
@@ -84,12 +91,18 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    LightBounds getLightBounds(){
+        // one-sided diffuse emitter: power pi * A * L, all along the normal
+        Vector3f e = m->getEmission();
+        return LightBounds(getBounds(), normal, M_PI * area * (e.x + e.y + e.z) / 3, 1, 0);
+    }
 };
 
 class MeshTriangle : public Object
 {
 public:
-    MeshTriangle(const std::string& filename, Material *mt = new Material())
+    MeshTriangle(const std::string& filename, Material *mt = new Material(),
+                 BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH)
     {
         objl::Loader loader;
         loader.LoadFile(filename);
@@ -98,52 +111,59 @@ public:
         assert(loader.LoadedMeshes.size() == 1);
         auto mesh = loader.LoadedMeshes[0];
 
-        Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity()};
-        Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-
-            for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
+        // The loader repeats the vertices of every face, so merge the ones
+        // with the same position and texture coordinates into one buffer
+        std::map<std::array<float, 5>, uint32_t> vertexMap;
+        std::vector<uint32_t> remap(mesh.Vertices.size());
+        for (size_t i = 0; i < mesh.Vertices.size(); ++i) {
+            const objl::Vertex& vert = mesh.Vertices[i];
+            std::array<float, 5> key = {vert.Position.X, vert.Position.Y, vert.Position.Z,
+                                        vert.TextureCoordinate.X, vert.TextureCoordinate.Y};
+            auto it = vertexMap.emplace(key, (uint32_t)triangleMesh.vertices.size());
+            if (it.second) {
+                triangleMesh.vertices.emplace_back(key[0], key[1], key[2]);
+                stCoordinates.emplace_back(key[3], key[4]);
             }
-
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
+            remap[i] = it.first->second;
         }
 
-        bounding_box = Bounds3(min_vert, max_vert);
-
-        std::vector<Object*> ptrs;
-        for (auto& tri : triangles){
-            ptrs.push_back(&tri);
-            area += tri.area;
+        triangleMesh.m = mt;
+        triangleMesh.object = this;
+        for (size_t i = 0; i + 2 < mesh.Indices.size(); i += 3)
+            triangleMesh.addFace(remap[mesh.Indices[i]], remap[mesh.Indices[i + 1]],
+                                 remap[mesh.Indices[i + 2]]);
+        numTriangles = triangleMesh.numFaces();
+
+        for (const Vector3f& vert : triangleMesh.vertices)
+            bounding_box = Union(bounding_box, vert);
+        for (uint32_t k = 0; k < numTriangles; ++k)
+            area += triangleMesh.faceArea(k);
+        bvh = new BVHAccel(triangleMesh, kTriangleBlockSize, splitMethod);
+
+        // Lights are sampled and weighted per triangle, so emissive meshes
+        // keep a Triangle for every face and report it as the object hit
+        if (m->hasEmission()) {
+            std::vector<float> areas;
+            for (uint32_t k = 0; k < numTriangles; ++k) {
+                triangles.emplace_back(triangleMesh.vertex(k, 0), triangleMesh.vertex(k, 1),
+                                       triangleMesh.vertex(k, 2), mt);
+                areas.push_back(triangles.back().area);
+            }
+            for (auto& tri : triangles)
+                triangleMesh.faceObjects.push_back(&tri);
+            triangleTable = AliasTable(areas);
         }
-        bvh = new BVHAccel(ptrs);
     }
 
-    bool intersect(const Ray& ray) { return true; }
+    bool intersect(const Ray& ray) { return bvh && bvh->IntersectP(ray); }
 
     bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
     {
         bool intersect = false;
         for (uint32_t k = 0; k < numTriangles; ++k) {
-            const Vector3f& v0 = vertices[vertexIndex[k * 3]];
-            const Vector3f& v1 = vertices[vertexIndex[k * 3 + 1]];
-            const Vector3f& v2 = vertices[vertexIndex[k * 3 + 2]];
+            const Vector3f& v0 = triangleMesh.vertex(k, 0);
+            const Vector3f& v1 = triangleMesh.vertex(k, 1);
+            const Vector3f& v2 = triangleMesh.vertex(k, 2);
             float t, u, v;
             if (rayTriangleIntersect(v0, v1, v2, ray.origin, ray.direction, t,
                                      u, v) &&
@@ -158,20 +178,22 @@ public:
     }
 
     Bounds3 getBounds() { return bounding_box; }
+    PrimitiveType primitiveType() const { return PrimitiveType::Mesh; }
+    const BVHAccel* getBVH() const { return bvh; }
 
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const
     {
-        const Vector3f& v0 = vertices[vertexIndex[index * 3]];
-        const Vector3f& v1 = vertices[vertexIndex[index * 3 + 1]];
-        const Vector3f& v2 = vertices[vertexIndex[index * 3 + 2]];
+        const Vector3f& v0 = triangleMesh.vertex(index, 0);
+        const Vector3f& v1 = triangleMesh.vertex(index, 1);
+        const Vector3f& v2 = triangleMesh.vertex(index, 2);
         Vector3f e0 = normalize(v1 - v0);
         Vector3f e1 = normalize(v2 - v1);
         N = normalize(crossProduct(e0, e1));
-        const Vector2f& st0 = stCoordinates[vertexIndex[index * 3]];
-        const Vector2f& st1 = stCoordinates[vertexIndex[index * 3 + 1]];
-        const Vector2f& st2 = stCoordinates[vertexIndex[index * 3 + 2]];
+        const Vector2f& st0 = stCoordinates[triangleMesh.vertexIndex[index * 3]];
+        const Vector2f& st1 = stCoordinates[triangleMesh.vertexIndex[index * 3 + 1]];
+        const Vector2f& st2 = stCoordinates[triangleMesh.vertexIndex[index * 3 + 2]];
         st = st0 * (1 - uv.x - uv.y) + st1 * uv.x + st2 * uv.y;
     }
 
@@ -194,9 +216,21 @@ public:
 
         return intersec;
     }
+
+    void getIntersectionPacket(RayPacket& packet, int mask, Intersection* isect)
+    {
+        if (bvh)
+            bvh->IntersectPacket(packet, mask, isect);
+    }
+
+    int intersectPacket(const RayPacket& packet, int mask) { return bvh ? bvh->IntersectPacketP(packet, mask) : 0; }
     
-    void Sample(Intersection &pos, float &pdf){
-        bvh->Sample(pos, pdf);
+    void Sample(Intersection &pos, float &pdf, Sampler &sampler){
+        // pick a triangle in proportion to its area, then a point on it
+        float pmf;
+        Triangle& tri = triangles[triangleTable.sample(sampler.get1D(), &pmf)];
+        tri.Sample(pos, pdf, sampler);
+        pdf *= pmf;
         pos.emit = m->getEmission();
     }
     float getArea(){
@@ -205,22 +239,34 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    void getEmitters(std::vector<Object*>& emitters){
+        if (hasEmit())
+            for (auto& tri : triangles)
+                emitters.push_back(&tri);
+    }
 
     Bounds3 bounding_box;
-    std::unique_ptr<Vector3f[]> vertices;
+    TriangleMesh triangleMesh;
     uint32_t numTriangles;
-    std::unique_ptr<uint32_t[]> vertexIndex;
-    std::unique_ptr<Vector2f[]> stCoordinates;
+    std::vector<Vector2f> stCoordinates;
 
+    // faces of emissive meshes, for the light samplers
     std::vector<Triangle> triangles;
 
     BVHAccel* bvh;
+    AliasTable triangleTable;
     float area;
 
     Material* m;
 };
 
-inline bool Triangle::intersect(const Ray& ray) { return true; }
+// Occlusion test: same as getIntersection, but only reports whether the
+// hit lies within [0, ray.t_max)
+inline bool Triangle::intersect(const Ray& ray)
+{
+    double t_tmp = intersectTriangle(ray, v0, e1, e2, normal);
+    return t_tmp >= 0 && t_tmp < ray.t_max;
+}
 inline bool Triangle::intersect(const Ray& ray, float& tnear,
                                 uint32_t& index) const
 {
@@ -233,25 +279,7 @@ inline Intersection Triangle::getIntersection(Ray ray)
 {
     Intersection inter;
 
-    if (dotProduct(ray.direction, normal) > 0)
-        return inter;
-    double u, v, t_tmp = 0;
-    Vector3f pvec = crossProduct(ray.direction, e2);
-    double det = dotProduct(e1, pvec);
-    if (fabs(det) < EPSILON)
-        return inter;
-
-    double det_inv = 1. / det;
-    Vector3f tvec = ray.origin - v0;
-    u = dotProduct(tvec, pvec) * det_inv;
-    if (u < 0 || u > 1)
-        return inter;
-    Vector3f qvec = crossProduct(tvec, e1);
-    v = dotProduct(ray.direction, qvec) * det_inv;
-    if (v < 0 || u + v > 1)
-        return inter;
-    t_tmp = dotProduct(e2, qvec) * det_inv;
-
+    double t_tmp = intersectTriangle(ray, v0, e1, e2, normal);
     if (t_tmp < 0)
     {
         return inter;
@@ -267,6 +295,29 @@ inline Intersection Triangle::getIntersection(Ray ray)
     return inter;
 }
 
+inline int Triangle::intersectLanes(const RayPacket& packet, int mask, float* tHit) const
+{
+    return intersectTriangleLanes(packet, mask, v0, e1, e2, normal, tHit);
+}
+
+inline void Triangle::getIntersectionPacket(RayPacket& packet, int mask, Intersection* isect)
+{
+    float tHit[kPacketSize];
+    int hitMask = intersectLanes(packet, mask, tHit);
+    for (int i = 0; i < kPacketSize; ++i) {
+        if (!(hitMask & (1 << i)))
+            continue;
+        Intersection& inter = isect[i];
+        inter.distance = tHit[i];
+        inter.coords = Vector3f(packet.ox[i], packet.oy[i], packet.oz[i]) +
+                       Vector3f(packet.dx[i], packet.dy[i], packet.dz[i]) * tHit[i];
+        inter.happened = true;
+        inter.m = m;
+        inter.normal = normal;
+        inter.obj = this;
+        packet.tMax[i] = tHit[i];
+    }
+}
 
 inline Vector3f Triangle::evalDiffuseColor(const Vector2f&) const
 {
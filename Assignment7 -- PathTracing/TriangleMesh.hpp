@@ -0,0 +1,364 @@
+//
+// Indexed triangle mesh storage.
+//
+
+#pragma once
+#include <cstdint>
+#include <vector>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "Bounds3.hpp"
+#include "Intersection.hpp"
+#include "Ray.hpp"
+#include "Vector.hpp"
+#include "global.hpp"
+
+class Object;
+
+// Test of a ray against the front of the triangle v0, v0 + e1, v0 + e2 with
+// the given normal. Returns the distance of the hit, negative if there is none.
+inline double intersectTriangle(const Ray& ray, const Vector3f& v0, const Vector3f& e1,
+                                const Vector3f& e2, const Vector3f& normal)
+{
+    if (dotProduct(ray.direction, normal) > 0)
+        return -1;
+    Vector3f pvec = crossProduct(ray.direction, e2);
+    double det = dotProduct(e1, pvec);
+    if (fabs(det) < EPSILON)
+        return -1;
+
+    double det_inv = 1. / det;
+    Vector3f tvec = ray.origin - v0;
+    double u = dotProduct(tvec, pvec) * det_inv;
+    if (u < 0 || u > 1)
+        return -1;
+    Vector3f qvec = crossProduct(tvec, e1);
+    double v = dotProduct(ray.direction, qvec) * det_inv;
+    if (v < 0 || u + v > 1)
+        return -1;
+    return dotProduct(e2, qvec) * det_inv;
+}
+
+// The same test for every ray of a packet at once, in float, with one Vec3x8
+// lane per ray. Returns the mask of the rays in mask that hit in [0, tMax)
+// and, if tHit is given, their distances.
+inline int intersectTriangleLanes(const RayPacket& packet, int mask, const Vector3f& v0, const Vector3f& e1,
+                                  const Vector3f& e2, const Vector3f& normal, float* tHit)
+{
+    static_assert(kPacketSize == 8, "packets are traced as Vec3x8");
+    Vec3x8 dir = Vec3x8::load(packet.dx, packet.dy, packet.dz);
+    Vec3x8 E1(e1), E2(e2);
+    Float8 facing = dot(dir, Vec3x8(normal));
+    Vec3x8 pvec = cross(dir, E2);
+    Float8 det = dot(E1, pvec);
+    Float8 det_inv = Float8(1.0f) / det;
+    Vec3x8 tvec = Vec3x8::load(packet.ox, packet.oy, packet.oz) - Vec3x8(v0);
+    Float8 u = dot(tvec, pvec) * det_inv;
+    Vec3x8 qvec = cross(tvec, E1);
+    Float8 v = dot(dir, qvec) * det_inv;
+    Float8 t = dot(E2, qvec) * det_inv;
+    const Float8 zero(0.0f), one(1.0f);
+    Float8 hit = (facing <= zero) & (abs(det) >= Float8(EPSILON)) & (u >= zero) & (u <= one) & (v >= zero) &
+                 (u + v <= one) & (t >= zero) & (t < Float8::load(packet.tMax));
+    if (tHit)
+        t.store(tHit);
+    return movemask(hit) & mask;
+}
+
+// Ray set up for the watertight ray-triangle test (Woop, Benthin and Wald,
+// "Watertight Ray/Triangle Intersection", 2013). The axes are permuted so
+// that z is the largest component of the direction, and a shear maps the
+// direction to (0, 0, 1); a triangle is then hit if the origin lies inside
+// its projection onto the xy plane. Edges shared by two triangles get exactly
+// opposite edge functions, so no ray slips through between them.
+struct WatertightRay
+{
+    int kx, ky, kz;
+    float Sx, Sy, Sz;
+    float org[3];
+
+    explicit WatertightRay(const Ray& ray)
+    {
+        const float dir[3] = {ray.direction.x, ray.direction.y, ray.direction.z};
+        kz = std::fabs(dir[0]) > std::fabs(dir[1]) ? (std::fabs(dir[0]) > std::fabs(dir[2]) ? 0 : 2)
+                                                   : (std::fabs(dir[1]) > std::fabs(dir[2]) ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // keep the winding of the triangles
+        if (dir[kz] < 0)
+            std::swap(kx, ky);
+        // dir[kz] is the largest component, never zero
+        Sz = rcp(dir[kz]);
+        Sx = dir[kx] * Sz;
+        Sy = dir[ky] * Sz;
+        org[0] = ray.origin.x;
+        org[1] = ray.origin.y;
+        org[2] = ray.origin.z;
+    }
+};
+
+// Watertight test of a ray against the front of the triangle p0 p1 p2, all in
+// float. On a hit in [0, tMax) returns its distance and the barycentric
+// weights u, v of p1 and p2.
+inline bool intersectTriangleWatertight(const WatertightRay& r, const Vector3f& p0, const Vector3f& p1,
+                                        const Vector3f& p2, float tMax, float& t, float& u, float& v)
+{
+    const float* a = &p0.x;
+    const float* b = &p1.x;
+    const float* c = &p2.x;
+    float Az = a[r.kz] - r.org[r.kz], Bz = b[r.kz] - r.org[r.kz], Cz = c[r.kz] - r.org[r.kz];
+    float Ax = (a[r.kx] - r.org[r.kx]) - r.Sx * Az, Ay = (a[r.ky] - r.org[r.ky]) - r.Sy * Az;
+    float Bx = (b[r.kx] - r.org[r.kx]) - r.Sx * Bz, By = (b[r.ky] - r.org[r.ky]) - r.Sy * Bz;
+    float Cx = (c[r.kx] - r.org[r.kx]) - r.Sx * Cz, Cy = (c[r.ky] - r.org[r.ky]) - r.Sy * Cz;
+    float U = Cx * By - Cy * Bx;
+    float V = Ax * Cy - Ay * Cx;
+    float W = Bx * Ay - By * Ax;
+    // det > 0 for a triangle that faces the ray, the others are culled
+    float det = U + V + W;
+    if (U < 0 || V < 0 || W < 0 || !(det > 0))
+        return false;
+    float T = U * (r.Sz * Az) + V * (r.Sz * Bz) + W * (r.Sz * Cz);
+    t = T / det;
+    if (!(t >= 0 && t < tMax))
+        return false;
+    u = V / det;
+    v = W / det;
+    return true;
+}
+
+// Triangles tested against a ray in one pass: one AVX2 register holds 8
+// floats, one SSE register 4
+#if defined(__AVX2__)
+constexpr int kTriangleBlockSize = 8;
+#else
+constexpr int kTriangleBlockSize = 4;
+#endif
+
+// Up to kTriangleBlockSize faces of a BVH leaf, with their vertices copied
+// out of the mesh in SoA layout
+struct alignas(32) TriangleBlock
+{
+    float v[3][3][kTriangleBlockSize];  // [vertex][axis][face]
+    int face[kTriangleBlockSize];
+    int n;
+};
+
+// Watertight test of one ray against every face of a block. Returns the mask
+// of the faces hit in [0, tMax) and stores the distance and the barycentric
+// weights of the second and third vertex of every face.
+inline int intersectTriangleBlock(const TriangleBlock& block, const WatertightRay& r, float tMax,
+                                  float t[kTriangleBlockSize], float u[kTriangleBlockSize],
+                                  float v[kTriangleBlockSize])
+{
+#if defined(__AVX2__)
+    const __m256 ox = _mm256_set1_ps(r.org[r.kx]), oy = _mm256_set1_ps(r.org[r.ky]);
+    const __m256 oz = _mm256_set1_ps(r.org[r.kz]);
+    const __m256 Sx = _mm256_set1_ps(r.Sx), Sy = _mm256_set1_ps(r.Sy), Sz = _mm256_set1_ps(r.Sz);
+    __m256 X[3], Y[3], Z[3];
+    for (int k = 0; k < 3; ++k) {
+        Z[k] = _mm256_sub_ps(_mm256_load_ps(block.v[k][r.kz]), oz);
+        X[k] = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.v[k][r.kx]), ox), _mm256_mul_ps(Sx, Z[k]));
+        Y[k] = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.v[k][r.ky]), oy), _mm256_mul_ps(Sy, Z[k]));
+    }
+    __m256 U = _mm256_sub_ps(_mm256_mul_ps(X[2], Y[1]), _mm256_mul_ps(Y[2], X[1]));
+    __m256 V = _mm256_sub_ps(_mm256_mul_ps(X[0], Y[2]), _mm256_mul_ps(Y[0], X[2]));
+    __m256 W = _mm256_sub_ps(_mm256_mul_ps(X[1], Y[0]), _mm256_mul_ps(Y[1], X[0]));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(U, V), W);
+    __m256 T = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(U, _mm256_mul_ps(Sz, Z[0])),
+                                           _mm256_mul_ps(V, _mm256_mul_ps(Sz, Z[1]))),
+                             _mm256_mul_ps(W, _mm256_mul_ps(Sz, Z[2])));
+    __m256 tHit = _mm256_div_ps(T, det);
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 hit = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(U, zero, _CMP_GE_OQ), _mm256_cmp_ps(V, zero, _CMP_GE_OQ)),
+                               _mm256_and_ps(_mm256_cmp_ps(W, zero, _CMP_GE_OQ), _mm256_cmp_ps(det, zero, _CMP_GT_OQ)));
+    hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(tHit, zero, _CMP_GE_OQ),
+                                           _mm256_cmp_ps(tHit, _mm256_set1_ps(tMax), _CMP_LT_OQ)));
+    int mask = _mm256_movemask_ps(hit) & ((1 << block.n) - 1);
+    if (mask) {
+        __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+        _mm256_storeu_ps(t, tHit);
+        _mm256_storeu_ps(u, _mm256_mul_ps(V, invDet));
+        _mm256_storeu_ps(v, _mm256_mul_ps(W, invDet));
+    }
+    return mask;
+#elif defined(__SSE2__)
+    const __m128 ox = _mm_set1_ps(r.org[r.kx]), oy = _mm_set1_ps(r.org[r.ky]), oz = _mm_set1_ps(r.org[r.kz]);
+    const __m128 Sx = _mm_set1_ps(r.Sx), Sy = _mm_set1_ps(r.Sy), Sz = _mm_set1_ps(r.Sz);
+    __m128 X[3], Y[3], Z[3];
+    for (int k = 0; k < 3; ++k) {
+        Z[k] = _mm_sub_ps(_mm_load_ps(block.v[k][r.kz]), oz);
+        X[k] = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.v[k][r.kx]), ox), _mm_mul_ps(Sx, Z[k]));
+        Y[k] = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.v[k][r.ky]), oy), _mm_mul_ps(Sy, Z[k]));
+    }
+    __m128 U = _mm_sub_ps(_mm_mul_ps(X[2], Y[1]), _mm_mul_ps(Y[2], X[1]));
+    __m128 V = _mm_sub_ps(_mm_mul_ps(X[0], Y[2]), _mm_mul_ps(Y[0], X[2]));
+    __m128 W = _mm_sub_ps(_mm_mul_ps(X[1], Y[0]), _mm_mul_ps(Y[1], X[0]));
+    __m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+    __m128 T = _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, _mm_mul_ps(Sz, Z[0])), _mm_mul_ps(V, _mm_mul_ps(Sz, Z[1]))),
+                          _mm_mul_ps(W, _mm_mul_ps(Sz, Z[2])));
+    __m128 tHit = _mm_div_ps(T, det);
+    const __m128 zero = _mm_setzero_ps();
+    __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(U, zero), _mm_cmpge_ps(V, zero)),
+                            _mm_and_ps(_mm_cmpge_ps(W, zero), _mm_cmpgt_ps(det, zero)));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(tHit, zero), _mm_cmplt_ps(tHit, _mm_set1_ps(tMax))));
+    int mask = _mm_movemask_ps(hit) & ((1 << block.n) - 1);
+    if (mask) {
+        __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+        _mm_storeu_ps(t, tHit);
+        _mm_storeu_ps(u, _mm_mul_ps(V, invDet));
+        _mm_storeu_ps(v, _mm_mul_ps(W, invDet));
+    }
+    return mask;
+#else
+    int mask = 0;
+    for (int i = 0; i < block.n; ++i) {
+        Vector3f p[3];
+        for (int k = 0; k < 3; ++k)
+            p[k] = Vector3f(block.v[k][0][i], block.v[k][1][i], block.v[k][2][i]);
+        if (intersectTriangleWatertight(r, p[0], p[1], p[2], tMax, t[i], u[i], v[i]))
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+// Triangles sharing one vertex buffer: face f has the vertices
+// vertexIndex[3f..3f+2], counter-clockwise, and its normal precomputed in the
+// SoA arrays nx, ny, nz. The BVH of a mesh stores face indices and tests them
+// straight from these arrays, so a mesh needs no Object per face.
+struct TriangleMesh
+{
+    std::vector<Vector3f> vertices;
+    std::vector<uint32_t> vertexIndex;
+    std::vector<float> nx, ny, nz;
+    Material* m = nullptr;
+    // reported as Intersection::obj of a hit, per face if faceObjects is filled
+    Object* object = nullptr;
+    std::vector<Object*> faceObjects;
+
+    int numFaces() const { return (int)nx.size(); }
+    void addFace(uint32_t i0, uint32_t i1, uint32_t i2)
+    {
+        vertexIndex.push_back(i0);
+        vertexIndex.push_back(i1);
+        vertexIndex.push_back(i2);
+        Vector3f n = normalize(crossProduct(vertices[i1] - vertices[i0], vertices[i2] - vertices[i0]));
+        nx.push_back(n.x);
+        ny.push_back(n.y);
+        nz.push_back(n.z);
+    }
+
+    const Vector3f& vertex(int face, int k) const { return vertices[vertexIndex[3 * face + k]]; }
+    Vector3f normal(int face) const { return Vector3f(nx[face], ny[face], nz[face]); }
+    Bounds3 faceBounds(int face) const { return Union(Bounds3(vertex(face, 0), vertex(face, 1)), vertex(face, 2)); }
+    float faceArea(int face) const
+    {
+        const Vector3f& v0 = vertex(face, 0);
+        return crossProduct(vertex(face, 1) - v0, vertex(face, 2) - v0).norm() * 0.5f;
+    }
+
+    // Replace isect by the hit of ray with face if there is one nearer
+    bool intersect(int face, const Ray& ray, Intersection& isect) const
+    {
+        float t = floatDistance(isect.distance), u, v;
+        if (!intersect(face, WatertightRay(ray), t, u, v))
+            return false;
+        interaction(face, ray, t, isect);
+        return true;
+    }
+    // Replace t and the barycentrics u, v by the hit with face of the ray set
+    // up as wr if it is nearer than t
+    bool intersect(int face, const WatertightRay& wr, float& t, float& u, float& v) const
+    {
+        return intersectTriangleWatertight(wr, vertex(face, 0), vertex(face, 1), vertex(face, 2), t, t, u, v);
+    }
+    // Whether ray hits face in [0, ray.t_max)
+    bool intersectP(int face, const Ray& ray) const
+    {
+        float t, u, v;
+        return intersectTriangleWatertight(WatertightRay(ray), vertex(face, 0), vertex(face, 1), vertex(face, 2),
+                                           floatDistance(ray.t_max), t, u, v);
+    }
+
+    // Copy the vertices of n <= kTriangleBlockSize faces into block
+    void fillBlock(TriangleBlock& block, const int* faces, int n) const
+    {
+        block = TriangleBlock();
+        block.n = n;
+        for (int i = 0; i < n; ++i) {
+            block.face[i] = faces[i];
+            for (int k = 0; k < 3; ++k) {
+                const Vector3f& p = vertex(faces[i], k);
+                block.v[k][0][i] = p.x;
+                block.v[k][1][i] = p.y;
+                block.v[k][2][i] = p.z;
+            }
+        }
+    }
+    // The same for the nearest hit with the faces of block. Returns the face
+    // hit, -1 if none is nearer than t.
+    int intersectBlock(const TriangleBlock& block, const WatertightRay& wr, float& t, float& u, float& v) const
+    {
+        alignas(32) float tHit[kTriangleBlockSize], uHit[kTriangleBlockSize], vHit[kTriangleBlockSize];
+        int hitMask = intersectTriangleBlock(block, wr, t, tHit, uHit, vHit);
+        if (!hitMask)
+            return -1;
+        int nearest = -1;
+        for (int i = 0; i < block.n; ++i)
+            if ((hitMask & (1 << i)) && (nearest < 0 || tHit[i] < tHit[nearest]))
+                nearest = i;
+        t = tHit[nearest];
+        u = uHit[nearest];
+        v = vHit[nearest];
+        return block.face[nearest];
+    }
+    // Whether ray hits one of the faces of block in [0, ray.t_max)
+    bool intersectBlockP(const TriangleBlock& block, const WatertightRay& wr, const Ray& ray) const
+    {
+        alignas(32) float t[kTriangleBlockSize], u[kTriangleBlockSize], v[kTriangleBlockSize];
+        return intersectTriangleBlock(block, wr, floatDistance(ray.t_max), t, u, v) != 0;
+    }
+
+    // Packet versions, see Object::getIntersectionPacket and intersectPacket
+    void intersectPacket(int face, RayPacket& packet, int mask, Intersection* isect) const
+    {
+        const Vector3f& v0 = vertex(face, 0);
+        Vector3f n = normal(face);
+        float tHit[kPacketSize];
+        int hitMask = intersectTriangleLanes(packet, mask, v0, vertex(face, 1) - v0, vertex(face, 2) - v0, n, tHit);
+        for (int i = 0; i < kPacketSize; ++i) {
+            if (!(hitMask & (1 << i)))
+                continue;
+            Intersection& inter = isect[i];
+            inter.distance = tHit[i];
+            inter.coords = Vector3f(packet.ox[i], packet.oy[i], packet.oz[i]) +
+                           Vector3f(packet.dx[i], packet.dy[i], packet.dz[i]) * tHit[i];
+            inter.happened = true;
+            inter.m = m;
+            inter.normal = n;
+            inter.obj = faceObjects.empty() ? object : faceObjects[face];
+            packet.tMax[i] = tHit[i];
+        }
+    }
+    int intersectPacketP(int face, const RayPacket& packet, int mask) const
+    {
+        const Vector3f& v0 = vertex(face, 0);
+        return intersectTriangleLanes(packet, mask, v0, vertex(face, 1) - v0, vertex(face, 2) - v0, normal(face),
+                                      nullptr);
+    }
+
+    // The Intersection of the hit of ray with face at distance t
+    void interaction(int face, const Ray& ray, float t, Intersection& isect) const
+    {
+        isect.distance = t;
+        isect.coords = ray(t);
+        isect.happened = true;
+        isect.m = m;
+        isect.normal = normal(face);
+        isect.emit = m->getEmission();
+        isect.obj = faceObjects.empty() ? object : faceObjects[face];
+    }
+};
@@ -0,0 +1,204 @@
+#include "Wavefront.hpp"
+#include "Material.hpp"
+
+int WavefrontIntegrator::addCameraRay(const Vector3f& origin, const Vector3f& direction, const Sampler& sampler)
+{
+    int index = (int)samplers.size();
+    samplers.push_back(sampler);
+    Lr.push_back(0); Lg.push_back(0); Lb.push_back(0);
+    betaR.push_back(1); betaG.push_back(1); betaB.push_back(1);
+    bsdfPdf.push_back(0);
+    prevPx.push_back(0); prevPy.push_back(0); prevPz.push_back(0);
+    prevNx.push_back(0); prevNy.push_back(0); prevNz.push_back(0);
+    rays.push(origin, direction, index);
+    return index;
+}
+
+void WavefrontIntegrator::trace(std::vector<Vector3f>& radiance)
+{
+    for (int depth = 0; rays.size() > 0; ++depth) {
+        intersectStage(depth);
+        sortStage();
+        shadeStage();
+        shadowStage(depth);
+        std::swap(rays, nextRays);
+    }
+
+    int n = size();
+    radiance.resize(n);
+    for (int i = 0; i < n; ++i)
+        radiance[i] = Vector3f(Lr[i], Lg[i], Lb[i]);
+
+    samplers.clear();
+    Lr.clear(); Lg.clear(); Lb.clear();
+    betaR.clear(); betaG.clear(); betaB.clear();
+    bsdfPdf.clear();
+    prevPx.clear(); prevPy.clear(); prevPz.clear();
+    prevNx.clear(); prevNy.clear(); prevNz.clear();
+}
+
+// Find the closest hit of every ray. Camera rays go in packets of
+// kPacketSize neighbours when usePackets is set; the later bounces scatter
+// too much for packets to pay off.
+void WavefrontIntegrator::intersectStage(int depth)
+{
+    hits.clear();
+    if (usePackets && depth == 0) {
+        for (size_t first = 0; first < rays.size(); first += kPacketSize) {
+            int n = (int)std::min(rays.size() - first, (size_t)kPacketSize);
+            RayPacket packet;
+            for (int lane = 0; lane < n; ++lane)
+                packet.set(lane, Ray(rays.origin(first + lane), rays.direction(first + lane)));
+            Intersection isect[kPacketSize];
+            scene.intersectPacket(packet, isect);
+            for (int lane = 0; lane < n; ++lane)
+                addHit(first + lane, depth, isect[lane]);
+        }
+        return;
+    }
+    for (size_t i = 0; i < rays.size(); ++i)
+        addHit(i, depth, scene.intersect(Ray(rays.origin(i), rays.direction(i))));
+}
+
+// Queue the hit of ray i for shading. Rays that hit a light end their path
+// there; the light adds its emission, weighted against light sampling after
+// the first bounce.
+void WavefrontIntegrator::addHit(size_t i, int depth, const Intersection& inter)
+{
+    if (!inter.happened)
+        return;
+    Vector3f dir = rays.direction(i);
+    int p = rays.path[i];
+
+    if (inter.m->hasEmission()) {
+        Vector3f Le = inter.m->getEmission();
+        float weight = 1;
+        if (depth > 0) {
+            float cosLight = dotProduct(-dir, inter.normal);
+            if (cosLight <= 0)
+                return;
+            Intersection ref;
+            ref.coords = Vector3f(prevPx[p], prevPy[p], prevPz[p]);
+            ref.normal = Vector3f(prevNx[p], prevNy[p], prevNz[p]);
+            float pdf_light_w = scene.pdfLight(ref, inter) * inter.distance * inter.distance / cosLight;
+            weight = powerHeuristic(bsdfPdf[p], pdf_light_w);
+        }
+        Lr[p] += betaR[p] * Le.x * weight;
+        Lg[p] += betaG[p] * Le.y * weight;
+        Lb[p] += betaB[p] * Le.z * weight;
+        return;
+    }
+
+    hits.px.push_back(inter.coords.x); hits.py.push_back(inter.coords.y); hits.pz.push_back(inter.coords.z);
+    hits.nx.push_back(inter.normal.x); hits.ny.push_back(inter.normal.y); hits.nz.push_back(inter.normal.z);
+    hits.wx.push_back(dir.x); hits.wy.push_back(dir.y); hits.wz.push_back(dir.z);
+    hits.material.push_back(inter.m);
+    hits.object.push_back(inter.obj);
+    hits.path.push_back(p);
+}
+
+// Counting sort of the hits by material type, so that the shading stage runs
+// the same BSDF code over long runs of hits
+void WavefrontIntegrator::sortStage()
+{
+    constexpr int nTypes = Microfacet + 1;
+    int offsets[nTypes + 1] = {};
+    for (Material* m : hits.material)
+        ++offsets[m->getType() + 1];
+    for (int t = 0; t < nTypes; ++t)
+        offsets[t + 1] += offsets[t];
+    shadeOrder.resize(hits.size());
+    for (size_t i = 0; i < hits.size(); ++i)
+        shadeOrder[offsets[hits.material[i]->getType()]++] = (int)i;
+}
+
+// Sample a light and the BSDF at every hit: the light sample becomes a shadow
+// ray carrying its contribution, the BSDF sample the next ray of the path
+void WavefrontIntegrator::shadeStage()
+{
+    shadowRays.clear();
+    nextRays.clear();
+    for (int h : shadeOrder) {
+        int p = hits.path[h];
+        Sampler& sampler = samplers[p];
+        Material* m = hits.material[h];
+        Vector3f objPos(hits.px[h], hits.py[h], hits.pz[h]);
+        Vector3f N(hits.nx[h], hits.ny[h], hits.nz[h]);
+        Vector3f wo(hits.wx[h], hits.wy[h], hits.wz[h]);
+        Vector3f beta(betaR[p], betaG[p], betaB[p]);
+
+        Intersection inter;
+        inter.happened = true;
+        inter.coords = objPos;
+        inter.normal = N;
+        inter.m = m;
+        inter.obj = hits.object[h];
+
+        Intersection lightInter;
+        float pdf_light = 0.0f;
+        scene.sampleLight(inter, lightInter, pdf_light, sampler);
+        const Vector3f& NN = lightInter.normal;
+        Vector3f diff = lightInter.coords - objPos;
+        Vector3f lightDir = diff.normalized();
+        float lightDistance = diff.x * diff.x + diff.y * diff.y + diff.z * diff.z;
+        if (pdf_light > 0 && dotProduct(-lightDir, NN) > 0) {
+            Vector3f f_r = m->eval(wo, lightDir, N);
+            float pdf_light_w = pdf_light * lightDistance / dotProduct(-lightDir, NN);
+            float weight = powerHeuristic(pdf_light_w, m->pdf(wo, lightDir, N));
+            Vector3f Ld = beta * lightInter.emit * f_r * dotProduct(lightDir, N) / pdf_light_w * weight;
+            shadowRays.rays.push(objPos, lightDir, p);
+            shadowRays.tMax.push_back(std::sqrt(lightDistance) - 1e-2);
+            shadowRays.Lr.push_back(Ld.x);
+            shadowRays.Lg.push_back(Ld.y);
+            shadowRays.Lb.push_back(Ld.z);
+        }
+
+        if (sampler.get1D() >= scene.RussianRoulette)
+            continue;
+        Vector3f nextDir = m->sample(wo, N, sampler).normalized();
+        float pdf = m->pdf(wo, nextDir, N);
+        if (pdf <= 0.0f)
+            continue;
+        Vector3f f_r = m->eval(wo, nextDir, N);
+        beta = beta * f_r * dotProduct(nextDir, N) / pdf / scene.RussianRoulette;
+        betaR[p] = beta.x; betaG[p] = beta.y; betaB[p] = beta.z;
+        bsdfPdf[p] = pdf;
+        prevPx[p] = objPos.x; prevPy[p] = objPos.y; prevPz[p] = objPos.z;
+        prevNx[p] = N.x; prevNy[p] = N.y; prevNz[p] = N.z;
+        nextRays.push(objPos, nextDir, p);
+    }
+}
+
+// Add the light of every unblocked shadow ray. Those of the first bounce
+// leave neighbouring hits toward the same lights and go in packets when
+// usePackets is set.
+void WavefrontIntegrator::shadowStage(int depth)
+{
+    auto shadowRay = [&](size_t i) {
+        Ray ray(shadowRays.rays.origin(i), shadowRays.rays.direction(i));
+        ray.t_max = shadowRays.tMax[i];
+        return ray;
+    };
+    auto addLight = [&](size_t i) {
+        int p = shadowRays.rays.path[i];
+        Lr[p] += shadowRays.Lr[i];
+        Lg[p] += shadowRays.Lg[i];
+        Lb[p] += shadowRays.Lb[i];
+    };
+    if (usePackets && depth == 0) {
+        for (size_t first = 0; first < shadowRays.size(); first += kPacketSize) {
+            int n = (int)std::min(shadowRays.size() - first, (size_t)kPacketSize);
+            RayPacket packet;
+            for (int lane = 0; lane < n; ++lane)
+                packet.set(lane, shadowRay(first + lane));
+            int occluded = scene.intersectPacketP(packet);
+            for (int lane = 0; lane < n; ++lane)
+                if (!(occluded & (1 << lane)))
+                    addLight(first + lane);
+        }
+        return;
+    }
+    for (size_t i = 0; i < shadowRays.size(); ++i)
+        if (!scene.intersectP(shadowRay(i)))
+            addLight(i);
+}
@@ -0,0 +1,115 @@
+//
+// Wavefront (stream) path tracing.
+//
+
+#pragma once
+#include <vector>
+#include "Scene.hpp"
+
+// Rays waiting for a stage, stored as structure of arrays
+struct RayQueue
+{
+    std::vector<float> ox, oy, oz;
+    std::vector<float> dx, dy, dz;
+    std::vector<int> path;  // index of the path the ray belongs to
+
+    size_t size() const { return path.size(); }
+    void clear()
+    {
+        ox.clear(); oy.clear(); oz.clear();
+        dx.clear(); dy.clear(); dz.clear();
+        path.clear();
+    }
+    void push(const Vector3f& o, const Vector3f& d, int pathIndex)
+    {
+        ox.push_back(o.x); oy.push_back(o.y); oz.push_back(o.z);
+        dx.push_back(d.x); dy.push_back(d.y); dz.push_back(d.z);
+        path.push_back(pathIndex);
+    }
+    Vector3f origin(size_t i) const { return Vector3f(ox[i], oy[i], oz[i]); }
+    Vector3f direction(size_t i) const { return Vector3f(dx[i], dy[i], dz[i]); }
+};
+
+// Surface hits waiting to be shaded
+struct HitQueue
+{
+    std::vector<float> px, py, pz;     // hit point
+    std::vector<float> nx, ny, nz;     // surface normal
+    std::vector<float> wx, wy, wz;     // direction of the ray that hit it
+    std::vector<Material*> material;
+    std::vector<Object*> object;
+    std::vector<int> path;
+
+    size_t size() const { return path.size(); }
+    void clear()
+    {
+        px.clear(); py.clear(); pz.clear();
+        nx.clear(); ny.clear(); nz.clear();
+        wx.clear(); wy.clear(); wz.clear();
+        material.clear();
+        object.clear();
+        path.clear();
+    }
+};
+
+// Shadow rays and the radiance each one adds to its path if unblocked
+struct ShadowQueue
+{
+    RayQueue rays;
+    std::vector<float> tMax;
+    std::vector<float> Lr, Lg, Lb;
+
+    size_t size() const { return rays.size(); }
+    void clear()
+    {
+        rays.clear();
+        tMax.clear();
+        Lr.clear(); Lg.clear(); Lb.clear();
+    }
+};
+
+// Path tracer that advances a whole batch of paths one stage at a time
+// instead of following each path to its end like Scene::castRay: intersect
+// every ray of the bounce, shade the hits sorted by material type, trace all
+// shadow rays, then continue with the rays the shading produced. It computes
+// the same estimator as castRay and draws the same random numbers from each
+// path's sampler, so a path gives the same radiance either way.
+class WavefrontIntegrator
+{
+public:
+    explicit WavefrontIntegrator(const Scene& scene) : scene(scene) {}
+
+    // Start a path along a camera ray, drawing its random numbers from sampler.
+    // Returns the index of the path.
+    int addCameraRay(const Vector3f& origin, const Vector3f& direction, const Sampler& sampler);
+    int size() const { return (int)samplers.size(); }
+    // Trace every path added since the last call and store the radiance of
+    // path i in radiance[i]
+    void trace(std::vector<Vector3f>& radiance);
+
+    // trace camera rays and their shadow rays in packets of kPacketSize
+    // consecutive paths, so paths should be added in blocks of neighbours
+    bool usePackets = false;
+
+private:
+    void intersectStage(int depth);
+    void addHit(size_t i, int depth, const Intersection& inter);
+    void sortStage();
+    void shadeStage();
+    void shadowStage(int depth);
+
+    const Scene& scene;
+
+    // per-path state
+    std::vector<Sampler> samplers;
+    std::vector<float> Lr, Lg, Lb;                    // radiance gathered so far
+    std::vector<float> betaR, betaG, betaB;           // throughput
+    std::vector<float> bsdfPdf;                       // pdf of the last BSDF sample
+    std::vector<float> prevPx, prevPy, prevPz;        // vertex the last BSDF sample left from
+    std::vector<float> prevNx, prevNy, prevNz;
+
+    RayQueue rays, nextRays;
+    HitQueue hits;
+    std::vector<int> shadeOrder;  // hits grouped by material type
+    ShadowQueue shadowRays;
+};
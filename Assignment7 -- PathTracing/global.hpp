@@ -1,7 +1,10 @@
 #pragma once
 #include <iostream>
 #include <cmath>
+#include <limits>
 #include <random>
+#include <string>
+#include "Sampler.hpp"
 
 #undef M_PI
 #define M_PI 3.141592653589793f
@@ -9,6 +12,12 @@
 extern const float  EPSILON;
 const float kInfinity = std::numeric_limits<float>::max();
 
+// A ray distance in float, the largest ones becoming infinity
+inline float floatDistance(double t)
+{
+    return t < std::numeric_limits<float>::max() ? (float)t : std::numeric_limits<float>::infinity();
+}
+
 inline float clamp(const float &lo, const float &hi, const float &v)
 { return std::max(lo, std::min(hi, v)); }
 
@@ -28,16 +37,23 @@ inline  bool solveQuadratic(const float &a, const float &b, const float &c, floa
     return true;
 }
 
+// The path tracer passes a Sampler down explicitly; this is for code that has
+// none at hand and draws from a randomly seeded per-thread generator
 inline float get_random_float()
 {
-    static std::random_device dev;
-    static std::mt19937 rng(dev());
-    static std::uniform_real_distribution<float> dist(0.f, 1.f); // distribution in range [1, 6]
+    thread_local Sampler sampler(std::random_device{}(), std::random_device{}());
+    return sampler.get1D();
+}
 
-    return dist(rng);
+// Power heuristic (beta = 2) weight of a sample from strategy f when strategy g
+// could have produced it too; both pdfs are per unit solid angle
+inline float powerHeuristic(float pdf_f, float pdf_g)
+{
+    float f = pdf_f * pdf_f, g = pdf_g * pdf_g;
+    return f + g > 0 ? f / (f + g) : 0;
 }
 
-inline void UpdateProgress(float progress)
+inline void UpdateProgress(float progress, const std::string& info = "")
 {
     int barWidth = 70;
 
@@ -48,6 +64,6 @@ inline void UpdateProgress(float progress)
         else if (i == pos) std::cout << ">";
         else std::cout << " ";
     }
-    std::cout << "] " << int(progress * 100.0) << " %\r";
+    std::cout << "] " << int(progress * 100.0) << " % " << info << "\r";
     std::cout.flush();
 };
@@ -0,0 +1,303 @@
+//
+// Vector math shared by the ray tracers of Assignment5, 6 and 7.
+//
+// Vec3 is the Vector3f of the tracers: three floats and nothing in double.
+// Vec3A is the same vector padded to 16 bytes so that it fits one SSE
+// register, and Vec3x8 holds eight vectors in SoA layout, one per lane of an
+// AVX2 register, for code that handles eight rays or triangles at once.
+// Without SSE2 or AVX2 they fall back to plain loops over floats.
+//
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#pragma region Fast reciprocal and inverse square root
+// The hardware estimates refined by one Newton-Raphson step, good to about
+// 22 bits instead of 12. x must be finite and not zero.
+inline float rcp(float x)
+{
+#if defined(__SSE2__)
+    float r = _mm_cvtss_f32(_mm_rcp_ss(_mm_set_ss(x)));
+    return r * (2.0f - x * r);
+#else
+    return 1.0f / x;
+#endif
+}
+
+inline float rsqrt(float x)
+{
+#if defined(__SSE2__)
+    float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return r * (1.5f - 0.5f * x * r * r);
+#else
+    return 1.0f / std::sqrt(x);
+#endif
+}
+#pragma endregion
+
+#pragma region Vec3
+class Vec3 {
+public:
+    float x, y, z;
+    Vec3() : x(0), y(0), z(0) {}
+    Vec3(float xx) : x(xx), y(xx), z(xx) {}
+    Vec3(float xx, float yy, float zz) : x(xx), y(yy), z(zz) {}
+    Vec3 operator * (const float &r) const { return Vec3(x * r, y * r, z * r); }
+    Vec3 operator / (const float &r) const { return Vec3(x / r, y / r, z / r); }
+
+    float norm() const { return std::sqrt(x * x + y * y + z * z); }
+    Vec3 normalized() const {
+        float n = std::sqrt(x * x + y * y + z * z);
+        return Vec3(x / n, y / n, z / n);
+    }
+
+    Vec3 operator * (const Vec3 &v) const { return Vec3(x * v.x, y * v.y, z * v.z); }
+    Vec3 operator - (const Vec3 &v) const { return Vec3(x - v.x, y - v.y, z - v.z); }
+    Vec3 operator + (const Vec3 &v) const { return Vec3(x + v.x, y + v.y, z + v.z); }
+    Vec3 operator - () const { return Vec3(-x, -y, -z); }
+    Vec3& operator += (const Vec3 &v) { x += v.x, y += v.y, z += v.z; return *this; }
+    friend Vec3 operator * (const float &r, const Vec3 &v)
+    { return Vec3(v.x * r, v.y * r, v.z * r); }
+    friend std::ostream & operator << (std::ostream &os, const Vec3 &v)
+    { return os << v.x << ", " << v.y << ", " << v.z; }
+    float operator[](int index) const { return (&x)[index]; }
+    float& operator[](int index) { return (&x)[index]; }
+
+    static Vec3 Min(const Vec3 &p1, const Vec3 &p2) {
+        return Vec3(std::min(p1.x, p2.x), std::min(p1.y, p2.y), std::min(p1.z, p2.z));
+    }
+
+    static Vec3 Max(const Vec3 &p1, const Vec3 &p2) {
+        return Vec3(std::max(p1.x, p2.x), std::max(p1.y, p2.y), std::max(p1.z, p2.z));
+    }
+};
+
+class Vec2
+{
+public:
+    Vec2() : x(0), y(0) {}
+    Vec2(float xx) : x(xx), y(xx) {}
+    Vec2(float xx, float yy) : x(xx), y(yy) {}
+    Vec2 operator * (const float &r) const { return Vec2(x * r, y * r); }
+    Vec2 operator + (const Vec2 &v) const { return Vec2(x + v.x, y + v.y); }
+    float x, y;
+};
+
+inline Vec3 lerp(const Vec3 &a, const Vec3& b, const float &t)
+{ return a * (1 - t) + b * t; }
+
+inline Vec3 normalize(const Vec3 &v)
+{
+    float mag2 = v.x * v.x + v.y * v.y + v.z * v.z;
+    if (mag2 > 0) {
+        float invMag = 1 / std::sqrt(mag2);
+        return Vec3(v.x * invMag, v.y * invMag, v.z * invMag);
+    }
+
+    return v;
+}
+
+// normalize through rsqrt, for directions that need not be exact to the last bit
+inline Vec3 normalizeFast(const Vec3 &v)
+{
+    float mag2 = v.x * v.x + v.y * v.y + v.z * v.z;
+    return mag2 > 0 ? v * rsqrt(mag2) : v;
+}
+
+inline float dotProduct(const Vec3 &a, const Vec3 &b)
+{ return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+inline Vec3 crossProduct(const Vec3 &a, const Vec3 &b)
+{
+    return Vec3(
+            a.y * b.z - a.z * b.y,
+            a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x
+    );
+}
+#pragma endregion
+
+#pragma region Vec3A
+// Vec3 padded with a w of 0 to 16 bytes, loaded into one SSE register by
+// every operation
+struct alignas(16) Vec3A
+{
+    float x, y, z, w;
+    Vec3A() : x(0), y(0), z(0), w(0) {}
+    Vec3A(float xx, float yy, float zz) : x(xx), y(yy), z(zz), w(0) {}
+    explicit Vec3A(const Vec3& v) : x(v.x), y(v.y), z(v.z), w(0) {}
+    Vec3 vec3() const { return Vec3(x, y, z); }
+#if defined(__SSE2__)
+    explicit Vec3A(__m128 m) { _mm_store_ps(&x, m); }
+    __m128 m128() const { return _mm_load_ps(&x); }
+#endif
+    float operator[](int index) const { return (&x)[index]; }
+};
+
+#if defined(__SSE2__)
+inline Vec3A operator + (const Vec3A& a, const Vec3A& b) { return Vec3A(_mm_add_ps(a.m128(), b.m128())); }
+inline Vec3A operator - (const Vec3A& a, const Vec3A& b) { return Vec3A(_mm_sub_ps(a.m128(), b.m128())); }
+inline Vec3A operator * (const Vec3A& a, const Vec3A& b) { return Vec3A(_mm_mul_ps(a.m128(), b.m128())); }
+inline Vec3A operator * (const Vec3A& a, float r) { return Vec3A(_mm_mul_ps(a.m128(), _mm_set1_ps(r))); }
+inline Vec3A min(const Vec3A& a, const Vec3A& b) { return Vec3A(_mm_min_ps(a.m128(), b.m128())); }
+inline Vec3A max(const Vec3A& a, const Vec3A& b) { return Vec3A(_mm_max_ps(a.m128(), b.m128())); }
+inline float dot(const Vec3A& a, const Vec3A& b)
+{
+    // w is 0 in both, so the sum of all four products
+    __m128 p = _mm_mul_ps(a.m128(), b.m128());
+    __m128 s = _mm_add_ps(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(2, 3, 0, 1))));
+}
+inline Vec3A cross(const Vec3A& a, const Vec3A& b)
+{
+    // a.yzx * b.zxy - a.zxy * b.yzx, computed as (a * b.yzx - a.yzx * b).yzx
+    __m128 ma = a.m128(), mb = b.m128();
+    __m128 a_yzx = _mm_shuffle_ps(ma, ma, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(mb, mb, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(ma, b_yzx), _mm_mul_ps(a_yzx, mb));
+    return Vec3A(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+#else
+inline Vec3A operator + (const Vec3A& a, const Vec3A& b) { return Vec3A(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline Vec3A operator - (const Vec3A& a, const Vec3A& b) { return Vec3A(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline Vec3A operator * (const Vec3A& a, const Vec3A& b) { return Vec3A(a.x * b.x, a.y * b.y, a.z * b.z); }
+inline Vec3A operator * (const Vec3A& a, float r) { return Vec3A(a.x * r, a.y * r, a.z * r); }
+inline Vec3A min(const Vec3A& a, const Vec3A& b)
+{ return Vec3A(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z)); }
+inline Vec3A max(const Vec3A& a, const Vec3A& b)
+{ return Vec3A(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z)); }
+inline float dot(const Vec3A& a, const Vec3A& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline Vec3A cross(const Vec3A& a, const Vec3A& b)
+{ return Vec3A(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x); }
+#endif
+
+inline float minComponent(const Vec3A& v) { return std::min(v.x, std::min(v.y, v.z)); }
+inline float maxComponent(const Vec3A& v) { return std::max(v.x, std::max(v.y, v.z)); }
+inline Vec3A normalize(const Vec3A& v)
+{
+    float mag2 = dot(v, v);
+    return mag2 > 0 ? v * rsqrt(mag2) : v;
+}
+#pragma endregion
+
+#pragma region Float8 and Vec3x8
+// Eight floats, one AVX2 register. Comparisons give a lane mask whose bits
+// are read with movemask.
+struct Float8
+{
+#if defined(__AVX2__)
+    __m256 m;
+    Float8() : m(_mm256_setzero_ps()) {}
+    Float8(float f) : m(_mm256_set1_ps(f)) {}
+    Float8(__m256 mm) : m(mm) {}
+    static Float8 load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, m); }
+#else
+    float m[8];
+    Float8() { std::fill(m, m + 8, 0.0f); }
+    Float8(float f) { std::fill(m, m + 8, f); }
+    static Float8 load(const float* p) { Float8 r; std::copy(p, p + 8, r.m); return r; }
+    void store(float* p) const { std::copy(m, m + 8, p); }
+#endif
+};
+
+#if defined(__AVX2__)
+inline Float8 operator + (const Float8& a, const Float8& b) { return _mm256_add_ps(a.m, b.m); }
+inline Float8 operator - (const Float8& a, const Float8& b) { return _mm256_sub_ps(a.m, b.m); }
+inline Float8 operator * (const Float8& a, const Float8& b) { return _mm256_mul_ps(a.m, b.m); }
+inline Float8 operator / (const Float8& a, const Float8& b) { return _mm256_div_ps(a.m, b.m); }
+inline Float8 operator & (const Float8& a, const Float8& b) { return _mm256_and_ps(a.m, b.m); }
+inline Float8 operator < (const Float8& a, const Float8& b) { return _mm256_cmp_ps(a.m, b.m, _CMP_LT_OQ); }
+inline Float8 operator <= (const Float8& a, const Float8& b) { return _mm256_cmp_ps(a.m, b.m, _CMP_LE_OQ); }
+inline Float8 operator >= (const Float8& a, const Float8& b) { return _mm256_cmp_ps(a.m, b.m, _CMP_GE_OQ); }
+inline Float8 operator > (const Float8& a, const Float8& b) { return _mm256_cmp_ps(a.m, b.m, _CMP_GT_OQ); }
+inline Float8 min(const Float8& a, const Float8& b) { return _mm256_min_ps(a.m, b.m); }
+inline Float8 max(const Float8& a, const Float8& b) { return _mm256_max_ps(a.m, b.m); }
+inline Float8 abs(const Float8& a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.m); }
+inline Float8 rcp(const Float8& a)
+{
+    __m256 r = _mm256_rcp_ps(a.m);
+    return _mm256_mul_ps(r, _mm256_sub_ps(_mm256_set1_ps(2.0f), _mm256_mul_ps(a.m, r)));
+}
+inline Float8 rsqrt(const Float8& a)
+{
+    __m256 r = _mm256_rsqrt_ps(a.m);
+    __m256 rr = _mm256_mul_ps(_mm256_mul_ps(a.m, r), r);
+    return _mm256_mul_ps(r, _mm256_sub_ps(_mm256_set1_ps(1.5f), _mm256_mul_ps(_mm256_set1_ps(0.5f), rr)));
+}
+inline int movemask(const Float8& a) { return _mm256_movemask_ps(a.m); }
+#else
+// lane-wise loops, with comparisons setting all bits of a lane like AVX
+template <typename F>
+inline Float8 lanes(F&& f)
+{
+    Float8 r;
+    for (int i = 0; i < 8; ++i)
+        r.m[i] = f(i);
+    return r;
+}
+inline float laneMask(bool b)
+{
+    float f;
+    unsigned bits = b ? ~0u : 0u;
+    std::memcpy(&f, &bits, sizeof f);
+    return f;
+}
+inline bool laneSet(float f)
+{
+    unsigned bits;
+    std::memcpy(&bits, &f, sizeof bits);
+    return bits >> 31;
+}
+inline Float8 operator + (const Float8& a, const Float8& b) { return lanes([&](int i) { return a.m[i] + b.m[i]; }); }
+inline Float8 operator - (const Float8& a, const Float8& b) { return lanes([&](int i) { return a.m[i] - b.m[i]; }); }
+inline Float8 operator * (const Float8& a, const Float8& b) { return lanes([&](int i) { return a.m[i] * b.m[i]; }); }
+inline Float8 operator / (const Float8& a, const Float8& b) { return lanes([&](int i) { return a.m[i] / b.m[i]; }); }
+inline Float8 operator & (const Float8& a, const Float8& b)
+{ return lanes([&](int i) { return laneMask(laneSet(a.m[i]) && laneSet(b.m[i])); }); }
+inline Float8 operator < (const Float8& a, const Float8& b) { return lanes([&](int i) { return laneMask(a.m[i] < b.m[i]); }); }
+inline Float8 operator <= (const Float8& a, const Float8& b) { return lanes([&](int i) { return laneMask(a.m[i] <= b.m[i]); }); }
+inline Float8 operator >= (const Float8& a, const Float8& b) { return lanes([&](int i) { return laneMask(a.m[i] >= b.m[i]); }); }
+inline Float8 operator > (const Float8& a, const Float8& b) { return lanes([&](int i) { return laneMask(a.m[i] > b.m[i]); }); }
+inline Float8 min(const Float8& a, const Float8& b) { return lanes([&](int i) { return std::min(a.m[i], b.m[i]); }); }
+inline Float8 max(const Float8& a, const Float8& b) { return lanes([&](int i) { return std::max(a.m[i], b.m[i]); }); }
+inline Float8 abs(const Float8& a) { return lanes([&](int i) { return std::fabs(a.m[i]); }); }
+inline Float8 rcp(const Float8& a) { return lanes([&](int i) { return rcp(a.m[i]); }); }
+inline Float8 rsqrt(const Float8& a) { return lanes([&](int i) { return rsqrt(a.m[i]); }); }
+inline int movemask(const Float8& a)
+{
+    int mask = 0;
+    for (int i = 0; i < 8; ++i)
+        mask |= (int)laneSet(a.m[i]) << i;
+    return mask;
+}
+#endif
+
+// Eight Vec3 in SoA layout
+struct Vec3x8
+{
+    Float8 x, y, z;
+    Vec3x8() {}
+    Vec3x8(const Float8& xx, const Float8& yy, const Float8& zz) : x(xx), y(yy), z(zz) {}
+    // the same vector in every lane
+    explicit Vec3x8(const Vec3& v) : x(v.x), y(v.y), z(v.z) {}
+    static Vec3x8 load(const float* px, const float* py, const float* pz)
+    { return Vec3x8(Float8::load(px), Float8::load(py), Float8::load(pz)); }
+};
+
+inline Vec3x8 operator + (const Vec3x8& a, const Vec3x8& b) { return Vec3x8(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline Vec3x8 operator - (const Vec3x8& a, const Vec3x8& b) { return Vec3x8(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline Vec3x8 operator * (const Vec3x8& a, const Float8& r) { return Vec3x8(a.x * r, a.y * r, a.z * r); }
+inline Float8 dot(const Vec3x8& a, const Vec3x8& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline Vec3x8 cross(const Vec3x8& a, const Vec3x8& b)
+{ return Vec3x8(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x); }
+// v must not be zero in any lane
+inline Vec3x8 normalize(const Vec3x8& v) { return v * rsqrt(dot(v, v)); }
+#pragma endregion